@@ -0,0 +1,69 @@
+#include "lkjscript.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+const char src[] =
+    "fn add(a, b) {\n"
+    "    return a + b\n"
+    "}\n"
+    "fn fib(n) {\n"
+    "    if n < 2 {\n"
+    "        return n\n"
+    "    }\n"
+    "    return fib(n - 1) + fib(n - 2)\n"
+    "}\n";
+
+int64_t bench_call(vm_t* vm, const char* name, const int64_t* argv, int64_t argc, int64_t n) {
+    symbol_t* fn = vm_find(vm, name);
+    int64_t sum = 0;
+    int64_t start = vm_now();
+    for (int64_t i = 0; i < n; i++) {
+        int64_t ret = 0;
+        if (fn == NULL || vm_call(vm, fn, argv, argc, &ret) != OK) {
+            printf("Error: Failed to call %s\n", name);
+            return -1;
+        }
+        sum += ret;
+    }
+    int64_t elapsed = vm_now() - start;
+    printf("call %s: calls=%" PRId64 " ns_per_call=%.1f checksum=%" PRId64 "\n", name, n, (double)elapsed / n, sum);
+    return elapsed;
+}
+
+// Compiles the source from scratch for every request, like one process per request minus the fork and exec.
+int64_t bench_recompile(vm_t* vm, int64_t n) {
+    int64_t argv[2] = {1, 2};
+    int64_t start = vm_now();
+    for (int64_t i = 0; i < n; i++) {
+        int64_t ret = 0;
+        if (compile_str(vm, src, sizeof(src) - 1) != OK || execute(vm) != OK || vm_call(vm, vm_find(vm, "add"), argv, 2, &ret) != OK) {
+            puts("Error: Failed to recompile");
+            return -1;
+        }
+    }
+    int64_t elapsed = vm_now() - start;
+    printf("recompile add: requests=%" PRId64 " ns_per_request=%.1f\n", n, (double)elapsed / n);
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    int64_t n = 1000000;
+    if (argc > 1 && sscanf(argv[1], "%" SCNd64, &n) != 1) {
+        puts("Usage: api_bench [calls]");
+        return 1;
+    }
+    vm_t vm;
+    if (vm_init(&vm) == ERR || compile_str(&vm, src, sizeof(src) - 1) == ERR || execute(&vm) == ERR) {
+        vm_free(&vm);
+        return 1;
+    }
+    int64_t add_argv[2] = {1, 2};
+    int64_t fib_argv[1] = {15};
+    int64_t result = 0;
+    if (bench_call(&vm, "add", add_argv, 2, n) < 0 || bench_call(&vm, "fib", fib_argv, 1, n / 1000) < 0 || bench_recompile(&vm, n / 1000) < 0) {
+        result = 1;
+    }
+    vm_free(&vm);
+    return result;
+}
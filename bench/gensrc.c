@@ -0,0 +1,68 @@
+#include "lkjscript.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Writes a synthetic lkjscript source of fn_cnt functions, each with loops, branches, comments and a call, plus
+// top-level code that calls every function once and prints a checksum. It stresses every compile stage.
+void gensrc_fn(int64_t i) {
+    printf("// Generated function %" PRId64 ": a bounded Collatz walk mixed with its arguments\n", i);
+    printf("fn generated_function_%" PRId64 "(first_argument, second_argument) {\n", i);
+    printf("    &accumulator = first_argument * %" PRId64 " + second_argument\n", i % 97 + 3);
+    printf("    &step = 0\n");
+    printf("    &walk = loop {\n");
+    printf("        if step > %" PRId64 " {\n", i % 13 + 4);
+    printf("            break accumulator\n");
+    printf("        }\n");
+    printf("        if (accumulator & 1) == 0 {\n");
+    printf("            &accumulator = accumulator / 2 + step\n");
+    printf("        } else {\n");
+    printf("            &accumulator = accumulator * 3 + 1\n");
+    printf("        }\n");
+    printf("        &step = step + 1\n");
+    printf("    }\n");
+    printf("    return generated_mix(walk, %" PRId64 ")\n", i);
+    printf("}\n\n");
+}
+
+int main(int argc, char** argv) {
+    int64_t fn_cnt = 800;
+    if (argc > 1 && (sscanf(argv[1], "%" SCNd64, &fn_cnt) != 1 || fn_cnt < 1 || fn_cnt > SYMBOL_MAX - 8)) {
+        printf("Usage: gensrc [functions (1 to %d)]\n", SYMBOL_MAX - 8);
+        return 1;
+    }
+    printf("fn putn(v) {\n");
+    printf("    &buf = _alloc(24)\n");
+    printf("    &i = 0\n");
+    printf("    &r = loop {\n");
+    printf("        &p = buf + i\n");
+    printf("        p = v %% 10 + 48\n");
+    printf("        &i = i + 1\n");
+    printf("        &v = v / 10\n");
+    printf("        if v == 0 {\n");
+    printf("            break 0\n");
+    printf("        }\n");
+    printf("    }\n");
+    printf("    &r = loop {\n");
+    printf("        if i == 0 {\n");
+    printf("            break 0\n");
+    printf("        }\n");
+    printf("        &i = i - 1\n");
+    printf("        &r = _write(1, buf + i, 1)\n");
+    printf("    }\n");
+    printf("    &r = _free(buf)\n");
+    printf("    return 0\n");
+    printf("}\n\n");
+    printf("fn generated_mix(value, salt) {\n");
+    printf("    return (value * 31 + salt) %% 1000003\n");
+    printf("}\n\n");
+    for (int64_t i = 0; i < fn_cnt; i++) {
+        gensrc_fn(i);
+    }
+    printf("&checksum = 0\n");
+    for (int64_t i = 0; i < fn_cnt; i++) {
+        printf("&checksum = (checksum + generated_function_%" PRId64 "(checksum %% 1000, %" PRId64 ")) %% 1000003\n", i, i);
+    }
+    printf("&r = putn(checksum)\n");
+    return 0;
+}
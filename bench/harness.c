@@ -0,0 +1,144 @@
+#include "lkjscript.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HARNESS_REP_MAX 64
+
+typedef struct {
+    int64_t wall_ns;
+    int64_t compile_ns;
+    int64_t stage_ns[STAGE_CNT];
+    int64_t dispatch;
+} harness_run_t;
+
+int harness_cmp(const void* a, const void* b) {
+    int64_t val_a = *(const int64_t*)a;
+    int64_t val_b = *(const int64_t*)b;
+    return (val_a > val_b) - (val_a < val_b);
+}
+
+int64_t harness_median(int64_t* val, int64_t n) {
+    qsort(val, n, sizeof(int64_t), harness_cmp);
+    return n % 2 == 1 ? val[n / 2] : (val[n / 2 - 1] + val[n / 2]) / 2;
+}
+
+// Compiles and runs src once in a fresh VM with stdin from in (or /dev/null) and stdout discarded. Stage timings
+// are always taken; dispatches are counted only when iscount is set, so timed runs use the plain dispatch loop.
+result_t harness_run(const char* src, const char* in, bool_t iscount, harness_run_t* run) {
+    vm_t vm;
+    result_t result = vm_init(&vm);
+    if (result == OK) {
+        result = vm_stats(&vm);
+    }
+    int in_fd = open(in != NULL ? in : "/dev/null", O_RDONLY);
+    int out_fd = open("/dev/null", O_WRONLY);
+    if (in_fd == -1 || out_fd == -1) {
+        printf("Error: Failed to open %s\n", in != NULL ? in : "/dev/null");
+        result = ERR;
+    }
+    vm.fd[0] = in_fd;
+    vm.fd[1] = out_fd;
+    int64_t start = vm_now();
+    if (result == OK && compile(&vm, src) == ERR) {
+        printf("Error: Failed to compile %s\n", src);
+        result = ERR;
+    }
+    run->compile_ns = vm_now() - start;
+    stats_t* stats = vm.stats;
+    if (result == OK) {
+        vm.stats = iscount ? stats : NULL;
+        start = vm_now();
+        result = execute(&vm);
+        run->wall_ns = vm_now() - start;
+        vm.stats = stats;
+        if (result != OK) {
+            printf("Error: Failed to execute %s\n", src);
+        }
+    }
+    if (stats != NULL) {
+        __builtin_memcpy(run->stage_ns, stats->stage_ns, sizeof(run->stage_ns));
+        run->dispatch = stats->dispatch;
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    vm_free(&vm);
+    return result;
+}
+
+// One counted run, then warmup untimed runs, then rep timed runs; prints one key=value line of medians.
+result_t harness_bench(const char* arg, int64_t warmup, int64_t rep) {
+    char src[4096];
+    snprintf(src, sizeof(src), "%s", arg);
+    char* in = strchr(src, ':');
+    if (in != NULL) {
+        *(in++) = '\0';
+    }
+    const char* name = strrchr(src, '/') != NULL ? strrchr(src, '/') + 1 : src;
+    harness_run_t count_run;
+    harness_run_t run[HARNESS_REP_MAX];
+    if (harness_run(src, in, TRUE, &count_run) == ERR) {
+        return ERR;
+    }
+    for (int64_t i = 0; i < warmup; i++) {
+        if (harness_run(src, in, FALSE, &run[0]) == ERR) {
+            return ERR;
+        }
+    }
+    for (int64_t i = 0; i < rep; i++) {
+        if (harness_run(src, in, FALSE, &run[i]) == ERR) {
+            return ERR;
+        }
+    }
+    int64_t val[HARNESS_REP_MAX];
+    for (int64_t i = 0; i < rep; i++) {
+        val[i] = run[i].wall_ns;
+    }
+    int64_t wall_ns = harness_median(val, rep);
+    int64_t wall_min_ns = val[0];
+    for (int64_t i = 0; i < rep; i++) {
+        val[i] = run[i].compile_ns;
+    }
+    int64_t compile_ns = harness_median(val, rep);
+    printf("bench: name=%s reps=%" PRId64 " wall_ns=%" PRId64 " wall_min_ns=%" PRId64 " dispatch=%" PRId64 " dispatch_per_sec=%" PRId64 " compile_ns=%" PRId64, name,
+           rep, wall_ns, wall_min_ns, count_run.dispatch, wall_ns == 0 ? 0 : (int64_t)(count_run.dispatch * 1e9 / wall_ns), compile_ns);
+    for (int64_t stage = 0; stage < STAGE_CNT; stage++) {
+        for (int64_t i = 0; i < rep; i++) {
+            val[i] = run[i].stage_ns[stage];
+        }
+        printf(" %s_ns=%" PRId64, stage_name[stage], harness_median(val, rep));
+    }
+    printf("\n");
+    fflush(stdout);
+    return OK;
+}
+
+int main(int argc, char** argv) {
+    int64_t warmup = 1;
+    int64_t rep = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:")) != -1) {
+        if (opt == 'w' && sscanf(optarg, "%" SCNd64, &warmup) == 1 && warmup >= 0) {
+            continue;
+        } else if (opt == 'r' && sscanf(optarg, "%" SCNd64, &rep) == 1 && 0 < rep && rep <= HARNESS_REP_MAX) {
+            continue;
+        }
+        puts("Usage: harness [-w warmup] [-r reps] src[:input]...");
+        return 1;
+    }
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        if (harness_bench(argv[i], warmup, rep) == ERR) {
+            status = 1;
+        }
+    }
+    return status;
+}
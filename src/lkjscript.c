@@ -1,120 +1,125 @@
+#include "lkjscript.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-#define SRC_PATH "./lkjscriptsrc"
-#define MEM_SIZE (1024 * 1024 * 16)
-#define MEM_GLOBAL_SIZE 32
-#define MEM_STACK_SIZE 256
-
-#define INT64_MAX 9223372036854775807
-
-typedef long long int64_t;
-
-typedef enum {
-    FALSE = 0,
-    TRUE = 1,
-} bool_t;
-
-typedef enum {
-    OK = 0,
-    ERR = 1,
-} result_t;
-
-typedef enum {
-    GLOBALADDR_ZERO,
-    GLOBALADDR_IP,
-    GLOBALADDR_SP,
-    GLOBALADDR_BP,
-} globaladdr_t;
-
-typedef enum {
-
-    TY_NULL,
-
-    TY_INST_NOP,
-    TY_INST_END,
-
-    TY_INST_PUSH_CONST,
-    TY_INST_PUSH_LOCAL_VAL,
-    TY_INST_PUSH_LOCAL_ADDR,
-    TY_INST_JMP,
-    TY_INST_JZ,
-    TY_INST_CALL,
-    TY_INST_RETURN,
-
-    TY_INST_ASSIGN1,
-    TY_INST_ASSIGN2,
-    TY_INST_ASSIGN3,
-    TY_INST_ASSIGN4,
-
-    TY_INST_OR,
-    TY_INST_AND,
-    TY_INST_EQ,
-    TY_INST_NE,
-    TY_INST_LT,
-    TY_INST_LE,
-    TY_INST_GT,
-    TY_INST_GE,
-    TY_INST_NOT,
-    TY_INST_ADD,
-    TY_INST_SUB,
-    TY_INST_MUL,
-    TY_INST_DIV,
-    TY_INST_MOD,
-    TY_INST_SHL,
-    TY_INST_SHR,
-    TY_INST_BITOR,
-    TY_INST_BITXOR,
-    TY_INST_BITAND,
-
-    TY_INST_DEREF,
-    TY_INST_NEG,
-    TY_INST_BITNOT,
-
-    TY_INST_READ,
-    TY_INST_WRITE,
-    TY_INST_USLEEP,
-
-    TY_LABEL,
-    TY_LABEL_SCOPE_OPEN,
-    TY_LABEL_SCOPE_CLOSE,
-
-} type_t;
-
-typedef struct {
-    const char* data;
-    int64_t size;
-} token_t;
-
-typedef struct {
-    type_t type;
-    token_t* token;
-    int64_t val;
-} node_t;
-
-typedef struct {
-    token_t* key;
-    int64_t val;
-} pair_t;
+builtin_t builtin[] = {
+    {.name = "_read", .type = TY_INST_READ, .argc = 3},
+    {.name = "_write", .type = TY_INST_WRITE, .argc = 3},
+    {.name = "_usleep", .type = TY_INST_USLEEP, .argc = 1},
+    {.name = "_memcpy", .type = TY_INST_MEMCPY, .argc = 3},
+    {.name = "_memset", .type = TY_INST_MEMSET, .argc = 3},
+    {.name = "_memcmp", .type = TY_INST_MEMCMP, .argc = 3},
+    {.name = "_memchr", .type = TY_INST_MEMCHR, .argc = 3},
+    {.name = "_vadd", .type = TY_INST_VADD, .argc = 4},
+    {.name = "_vsub", .type = TY_INST_VSUB, .argc = 4},
+    {.name = "_vmul", .type = TY_INST_VMUL, .argc = 4},
+    {.name = "_vshl", .type = TY_INST_VSHL, .argc = 4},
+    {.name = "_vshr", .type = TY_INST_VSHR, .argc = 4},
+    {.name = "_vadds", .type = TY_INST_VADDS, .argc = 4},
+    {.name = "_vsubs", .type = TY_INST_VSUBS, .argc = 4},
+    {.name = "_vmuls", .type = TY_INST_VMULS, .argc = 4},
+    {.name = "_vshls", .type = TY_INST_VSHLS, .argc = 4},
+    {.name = "_vshrs", .type = TY_INST_VSHRS, .argc = 4},
+    {.name = "_vmulshr", .type = TY_INST_VMULSHR, .argc = 5},
+    {.name = "_vsum", .type = TY_INST_VSUM, .argc = 2},
+    {.name = "_vmin", .type = TY_INST_VMIN, .argc = 2},
+    {.name = "_vmax", .type = TY_INST_VMAX, .argc = 2},
+    {.name = "_vdot", .type = TY_INST_VDOT, .argc = 3},
+    {.name = "_alloc", .type = TY_INST_ALLOC, .argc = 1},
+    {.name = "_free", .type = TY_INST_FREE, .argc = 1},
+    {.name = "_heapstat", .type = TY_INST_HEAPSTAT, .argc = 1},
+    {.name = "_mmap", .type = TY_INST_MMAP, .argc = 2},
+    {.name = "_munmap", .type = TY_INST_MUNMAP, .argc = 2},
+    {.name = "_memostat", .type = TY_INST_MEMOSTAT, .argc = 1},
+    {.name = "_spawn", .type = TY_INST_SPAWN, .argc = 2},
+    {.name = "_join", .type = TY_INST_JOIN, .argc = 1},
+    {.name = "_pfor", .type = TY_INST_PFOR, .argc = 3},
+    {.name = "_fetchadd", .type = TY_INST_FETCHADD, .argc = 2},
+    {.name = "_cas", .type = TY_INST_CAS, .argc = 3},
+    {.name = "_go", .type = TY_INST_GO, .argc = 2},
+    {.name = "_yield", .type = TY_INST_YIELD, .argc = 0},
+    {.name = "_snapshot", .type = TY_INST_SNAPSHOT, .argc = 0},
+    {.name = NULL, .type = TY_NULL, .argc = 0},
+};
 
-typedef struct {
-    int64_t bin[MEM_SIZE / sizeof(int64_t) / 6];
-    char src[MEM_SIZE / sizeof(char) / 6];
-    token_t token[MEM_SIZE / sizeof(token_t) / 6];
-    node_t node[MEM_SIZE / sizeof(node_t) / 6];
-    pair_t map[MEM_SIZE / sizeof(pair_t) / 6];
-} compile_t;
+const char* stage_name[STAGE_CNT] = {"read", "tokenize", "parse", "layout", "analyze", "purity", "tobin", "link", "symbol", "verify"};
 
-typedef union {
-    int64_t bin[MEM_SIZE / sizeof(int64_t)];
-    compile_t compile;
-} mem_t;
+// Opcodes without a source-level name; builtins are named by builtin[].
+const char* inst_name[STATS_OP_CNT] = {
+    [TY_INST_NOP] = "nop",
+    [TY_INST_END] = "end",
+    [TY_INST_CO_EXIT] = "co_exit",
+    [TY_INST_PUSH_CONST] = "push_const",
+    [TY_INST_PUSH_LOCAL_VAL] = "push_local_val",
+    [TY_INST_PUSH_LOCAL_ADDR] = "push_local_addr",
+    [TY_INST_PUSH_FN] = "push_fn",
+    [TY_INST_PUSH_CONST8] = "push_const8",
+    [TY_INST_PUSH_CONST32] = "push_const32",
+    [TY_INST_PUSH_LOCAL_VAL8] = "push_local_val8",
+    [TY_INST_PUSH_LOCAL_ADDR8] = "push_local_addr8",
+    [TY_INST_JMP] = "jmp",
+    [TY_INST_JZ] = "jz",
+    [TY_INST_JNZ] = "jnz",
+    [TY_INST_CALL] = "call",
+    [TY_INST_RETURN] = "return",
+    [TY_INST_MEMO_ENTER] = "memo_enter",
+    [TY_INST_MEMO_RETURN] = "memo_return",
+    [TY_INST_ASSIGN1] = "assign",
+    [TY_INST_ASSIGN2] = "assign8",
+    [TY_INST_ASSIGN3] = "assign32",
+    [TY_INST_ASSIGN4] = "assign4",
+    [TY_INST_OR] = "or",
+    [TY_INST_AND] = "and",
+    [TY_INST_EQ] = "eq",
+    [TY_INST_NE] = "ne",
+    [TY_INST_LT] = "lt",
+    [TY_INST_LE] = "le",
+    [TY_INST_GT] = "gt",
+    [TY_INST_GE] = "ge",
+    [TY_INST_NOT] = "not",
+    [TY_INST_ADD] = "add",
+    [TY_INST_SUB] = "sub",
+    [TY_INST_MUL] = "mul",
+    [TY_INST_DIV] = "div",
+    [TY_INST_MOD] = "mod",
+    [TY_INST_SHL] = "shl",
+    [TY_INST_SHR] = "shr",
+    [TY_INST_BITOR] = "bitor",
+    [TY_INST_BITXOR] = "bitxor",
+    [TY_INST_BITAND] = "bitand",
+    [TY_INST_DEREF] = "deref",
+    [TY_INST_DEREF8] = "deref8",
+    [TY_INST_DEREF32] = "deref32",
+    [TY_INST_NEG] = "neg",
+    [TY_INST_BITNOT] = "bitnot",
+};
 
-mem_t mem;
+result_t compile_parse_or(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
+result_t compile_parse_expr(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
+result_t compile_parse_stat(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
+void task_pool_free(task_pool_t* pool);
+void co_free(vm_t* vm);
+void profile_stop();
 
-result_t compile_parse_or(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
-result_t compile_parse_expr(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
-result_t compile_parse_stat(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break);
+// The context executing on this thread and its registers, published for the SIGPROF handler.
+__thread vm_t* profile_vm = NULL;
+__thread int64_t profile_ip = 0;
+__thread int64_t profile_bp = 0;
+int64_t profile_user = 0;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 bool_t token_iseq(token_t* token1, token_t* token2) {
     if (token1 == NULL || token2 == NULL) {
@@ -164,37 +169,287 @@ int64_t token_toint(token_t* token) {
     return result * sign;
 }
 
-pair_t* map_find(token_t* token, int64_t map_cnt) {
+pair_t* map_find(vm_t* vm, token_t* token, int64_t map_cnt) {
     for (int64_t i = 0; i < map_cnt; i++) {
-        if (token_iseq(token, mem.compile.map[i].key)) {
-            return &mem.compile.map[i];
+        if (token_iseq(token, vm->mem->compile.map[i].key)) {
+            return &vm->mem->compile.map[i];
+        }
+    }
+    return &vm->mem->compile.map[map_cnt];
+}
+
+pair_t* map_end(vm_t* vm, int64_t map_cnt) {
+    return &vm->mem->compile.map[map_cnt];
+}
+
+builtin_t* builtin_find(token_t* token) {
+    for (builtin_t* itr = builtin; itr->name != NULL; itr++) {
+        if (token_iseqstr(token, itr->name)) {
+            return itr;
+        }
+    }
+    return NULL;
+}
+
+// FNV-1a over the source text; profiles are keyed by it.
+uint64_t pgo_hash(const char* src) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *src != '\0'; src++) {
+        hash = (hash ^ (uint8_t)*src) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The loaded profile's counts for the site keyed by token, or NULL without a matching profile.
+pgo_site_t* pgo_find(vm_t* vm, token_t* token) {
+    pgo_t* pgo = vm->pgo_use;
+    if (pgo == NULL || !pgo->ismatch) {
+        return NULL;
+    }
+    int64_t key = token - vm->mem->compile.token;
+    int64_t lo = 0;
+    int64_t hi = pgo->site_cnt;
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if (pgo->site[mid].token < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < pgo->site_cnt && pgo->site[lo].token == key ? &pgo->site[lo] : NULL;
+}
+
+// Records an instrumented site at addr; compile_tobin emits code in address order, so the sites stay sorted by addr.
+void pgo_mark(vm_t* vm, node_t* node, type_t type, int64_t addr) {
+    pgo_t* pgo = vm->pgo;
+    bool_t issite = type == TY_INST_JZ || type == TY_INST_JNZ || type == TY_INST_CALL || type == TY_INST_JMP;
+    if (pgo == NULL || !issite || node->token == NULL || pgo->site_cnt == PGO_SITE_MAX) {
+        return;
+    }
+    pgo_site_t* site = &pgo->site[pgo->site_cnt++];
+    *site = (pgo_site_t){.token = node->token - vm->mem->compile.token, .addr = addr, .type = type, .cnt = {0, 0}, .name_size = 0};
+    if (type == TY_INST_CALL) {
+        site->name_size = node->token->size < SYMBOL_NAME_MAX ? node->token->size : SYMBOL_NAME_MAX;
+        __builtin_memcpy(site->name, node->token->data, site->name_size);
+    }
+}
+
+bool_t mem_isrange(int64_t addr, int64_t n) {
+    int64_t size = (MEM_SIZE + MEM_MAP_SIZE) / sizeof(int64_t);
+    return 0 <= addr && addr <= size && 0 <= n && n <= size - addr;
+}
+
+// Bounds for checked execution, with addr counting units of size bytes. Scripts may read all of mem.bin but write only
+// past the code, so the globals and the bytecode compile_verify proved stay as they were, and not into the read-only
+// files _mmap placed below GLOBALADDR_MAP_TOP.
+__attribute__((always_inline)) static inline bool_t mem_ischecked(vm_t* vm, int64_t addr, int64_t size, int64_t n, bool_t iswrite) {
+    int64_t limit = sizeof(mem_t) / size;
+    if (addr < 0 || limit < addr || n < 0 || (limit - addr) * size < n) {
+        return FALSE;
+    }
+    if (!iswrite) {
+        return TRUE;
+    }
+    if (addr * size < (vm->code_end / (int64_t)sizeof(int64_t) + 1) * (int64_t)sizeof(int64_t)) {
+        return FALSE;
+    }
+    return addr * size + n <= MEM_SIZE || vm->mem->bin[GLOBALADDR_MAP_TOP] * (int64_t)sizeof(int64_t) <= addr * size;
+}
+
+// Where checked execution may fetch an instruction: the code, or the END and CO_EXIT words that vm_call, tasks and
+// coroutines return through.
+__attribute__((always_inline)) static inline bool_t vm_iscode(vm_t* vm, int64_t ip) {
+    return (CODE_ADDR(MEM_GLOBAL_SIZE) <= ip && ip < vm->code_end) || ip == CODE_ADDR(GLOBALADDR_END) || ip == CODE_ADDR(GLOBALADDR_CO_EXIT);
+}
+
+// The saved ip, sp and bp a return restores live in writable stack memory, so checked execution validates them: sp
+// must leave room for a frame past the code, and a frame resumed in the code needs bp between the code and sp. The
+// END and CO_EXIT words ignore bp, and vm_call, tasks and coroutines save it as 0.
+__attribute__((always_inline)) static inline bool_t vm_isframe(vm_t* vm, int64_t ip, int64_t sp, int64_t bp) {
+    if (!mem_ischecked(vm, sp, sizeof(int64_t), MEM_STACK_SIZE * sizeof(int64_t), TRUE)) {
+        return FALSE;
+    }
+    if (ip == CODE_ADDR(GLOBALADDR_END) || ip == CODE_ADDR(GLOBALADDR_CO_EXIT)) {
+        return TRUE;
+    }
+    return vm_iscode(vm, ip) && mem_ischecked(vm, bp, sizeof(int64_t), 0, TRUE) && bp <= sp;
+}
+
+// Takes up to want fuel from a budget that several contexts draw from at once.
+int64_t fuel_take(int64_t* budget, int64_t want) {
+    int64_t left = __atomic_load_n(budget, __ATOMIC_RELAXED);
+    int64_t take = 0;
+    do {
+        take = left <= 0 ? 0 : left < want ? left : want;
+    } while (take > 0 && !__atomic_compare_exchange_n(budget, &left, left - take, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return take;
+}
+
+// Fuel is spent at backward jumps (the bytes jumped back over) and calls; running out enters vm_refuel. A budget is
+// handed out FUEL_BUDGET_GRANT at a time; once a task pool runs, every context (tasks and the top-level code) takes
+// its grants from the pool's shared budget, so the script as a whole stays within it.
+void vm_setfuel(vm_t* vm) {
+    int64_t grant = INT64_MAX;
+    if (vm->slice > 0) {
+        grant = vm->slice;
+    }
+    if (vm->deadline > 0 && grant > FUEL_TIME_INTERVAL) {
+        grant = FUEL_TIME_INTERVAL;
+    }
+    if (vm->budget >= 0 && grant > FUEL_BUDGET_GRANT) {
+        grant = FUEL_BUDGET_GRANT;
+    }
+    if (vm->budget >= 0 && vm->pool != NULL) {
+        grant = fuel_take(&vm->pool->budget, grant);
+    } else if (vm->budget >= 0 && grant > vm->budget) {
+        grant = vm->budget;
+    }
+    vm->fuel = grant;
+    vm->grant = grant;
+}
+
+int64_t vm_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+result_t vm_refuel(vm_t* vm) {
+    if (vm->budget >= 0 && vm->pool != NULL) {
+        if (vm->fuel < 0 && __atomic_add_fetch(&vm->pool->budget, vm->fuel, __ATOMIC_RELAXED) < 0) {
+            return EXHAUST;
+        }
+    } else if (vm->budget >= 0) {
+        vm->budget -= vm->grant - vm->fuel;
+        if (vm->budget < 0) {
+            return EXHAUST;
         }
     }
-    return &mem.compile.map[map_cnt];
+    if (vm->deadline > 0 && vm_now() >= vm->deadline) {
+        return EXHAUST;
+    }
+    vm_setfuel(vm);
+    return vm->slice > 0 ? SUSPEND : OK;
+}
+
+result_t vm_init(vm_t* vm) {
+    vm->pool = NULL;
+    vm->worker = 0;
+    vm->worker_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    vm->sched = NULL;
+    vm->budget = -1;
+    vm->deadline = 0;
+    vm->slice = 0;
+    vm->issnapshot = FALSE;
+    vm->ischecked = FALSE;
+    vm->profile = NULL;
+    vm->pgo = NULL;
+    vm->pgo_use = NULL;
+    vm->stats = NULL;
+    vm->ip = 0;
+    vm->sp = 0;
+    vm->bp = 0;
+    vm->stack_end = MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE - (TASK_WORKER_MAX - 1) * MEM_TASK_STACK_SIZE;
+    vm->fd[0] = STDIN_FILENO;
+    vm->fd[1] = STDOUT_FILENO;
+    vm->fd[2] = STDERR_FILENO;
+    vm_setfuel(vm);
+    vm->mem = mmap(NULL, sizeof(mem_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    vm->memo = mmap(NULL, sizeof(memo_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    vm->symbol = mmap(NULL, sizeof(symbol_t) * SYMBOL_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    vm->symbol_cnt = 0;
+    vm->debug = mmap(NULL, sizeof(debug_t) * DEBUG_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    vm->debug_cnt = 0;
+    vm->fn_end = 0;
+    vm->code_end = 0;
+    if (vm->mem == MAP_FAILED || vm->memo == MAP_FAILED || vm->symbol == MAP_FAILED || vm->debug == MAP_FAILED) {
+        puts("Error: Failed to allocate VM memory");
+        return ERR;
+    }
+    return OK;
+}
+
+void vm_free(vm_t* vm) {
+    if (vm->sched != NULL) {
+        co_free(vm);
+    }
+    if (vm->pool != NULL) {
+        task_pool_free(vm->pool);
+    }
+    if (vm->mem != MAP_FAILED) {
+        munmap(vm->mem, sizeof(mem_t));
+    }
+    if (vm->memo != MAP_FAILED) {
+        munmap(vm->memo, sizeof(memo_t));
+    }
+    if (vm->symbol != MAP_FAILED) {
+        munmap(vm->symbol, sizeof(symbol_t) * SYMBOL_MAX);
+    }
+    if (vm->debug != MAP_FAILED) {
+        munmap(vm->debug, sizeof(debug_t) * DEBUG_MAX);
+    }
+    if (vm->profile != NULL) {
+        profile_stop();
+        munmap(vm->profile, sizeof(profile_t));
+    }
+    if (vm->pgo != NULL) {
+        munmap(vm->pgo, sizeof(pgo_t));
+    }
+    if (vm->pgo_use != NULL) {
+        munmap(vm->pgo_use, sizeof(pgo_t));
+    }
+    if (vm->stats != NULL) {
+        munmap(vm->stats, sizeof(stats_t));
+    }
+}
+
+int64_t vm_fd(vm_t* vm, int64_t fd) {
+    return 0 <= fd && fd < 3 ? vm->fd[fd] : fd;
+}
+
+void vm_lock(vm_t* vm) {
+    if (vm->pool != NULL) {
+        pthread_mutex_lock(&vm->pool->lock);
+    }
 }
 
-pair_t* map_end(int64_t map_cnt) {
-    return &mem.compile.map[map_cnt];
+void vm_unlock(vm_t* vm) {
+    if (vm->pool != NULL) {
+        pthread_mutex_unlock(&vm->pool->lock);
+    }
 }
 
-result_t compile_readsrc() {
-    FILE* fp = fopen(SRC_PATH, "r");
+result_t compile_readsrc(vm_t* vm, const char* path) {
+    FILE* fp = fopen(path, "r");
     if (fp == NULL) {
-        puts("Error: Failed to open lkjscriptsrc");
+        printf("Error: Failed to open %s\n", path);
         return ERR;
     }
-    size_t n = fread(mem.compile.src, 1, sizeof(mem.compile.src) - 3, fp);
-    mem.compile.src[n + 0] = '\n';
-    mem.compile.src[n + 1] = '\0';
-    mem.compile.src[n + 2] = '\0';
+    size_t n = fread(vm->mem->compile.src, 1, sizeof(vm->mem->compile.src) - 3, fp);
+    vm->mem->compile.src[n + 0] = '\n';
+    vm->mem->compile.src[n + 1] = '\0';
+    vm->mem->compile.src[n + 2] = '\0';
     fclose(fp);
     return OK;
 }
 
-result_t compile_tokenize() {
-    token_t* token_itr = mem.compile.token;
-    const char* base_itr = mem.compile.src;
-    const char* corrent_itr = mem.compile.src;
+result_t compile_loadsrc(vm_t* vm, const char* src, int64_t size) {
+    if (size < 0 || size > (int64_t)sizeof(vm->mem->compile.src) - 3) {
+        puts("Error: Source too large");
+        return ERR;
+    }
+    __builtin_memcpy(vm->mem->compile.src, src, size);
+    vm->mem->compile.src[size + 0] = '\n';
+    vm->mem->compile.src[size + 1] = '\0';
+    vm->mem->compile.src[size + 2] = '\0';
+    return OK;
+}
+
+result_t compile_tokenize(vm_t* vm) {
+    token_t* token_itr = vm->mem->compile.token;
+    const char* base_itr = vm->mem->compile.src;
+    const char* corrent_itr = vm->mem->compile.src;
     bool_t iscomment = FALSE;
     while (1) {
         char ch1 = *(corrent_itr + 0);
@@ -228,7 +483,9 @@ result_t compile_tokenize() {
             (ch1 == '=' && ch2 == '=') ||
             (ch1 == '!' && ch2 == '=') ||
             (ch1 == '&' && ch2 == '&') ||
-            (ch1 == '|' && ch2 == '|')) {
+            (ch1 == '|' && ch2 == '|') ||
+            (ch1 == '.' && ch2 == '=') ||
+            (ch1 == ':' && ch2 == '=')) {
             if (base_itr != corrent_itr) {
                 *(token_itr++) = (token_t){.data = base_itr, .size = corrent_itr - base_itr};
             }
@@ -259,13 +516,28 @@ void compile_parse_skiplinebreak(token_t** token_itr) {
     }
 }
 
-result_t compile_parse_primary(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+// Brackets a block for compile_layout to move behind its function: it is entered at label and falls back to label_back,
+// unless it already ends in a jump or return.
+void compile_parse_cold_open(node_t** node_itr, int64_t label) {
+    *((*node_itr)++) = (node_t){.type = TY_LABEL_COLD_OPEN, .token = NULL, .val = 0};
+    *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label};
+}
+
+void compile_parse_cold_close(node_t** node_itr, int64_t label_back) {
+    type_t last = (*node_itr - 1)->type;
+    if (last != TY_INST_JMP && last != TY_INST_RETURN) {
+        *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_back};
+    }
+    *((*node_itr)++) = (node_t){.type = TY_LABEL_COLD_CLOSE, .token = NULL, .val = 0};
+}
+
+result_t compile_parse_primary(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
     if ((*token_itr)->data == NULL) {
         puts("Error: Unexpected end of input in compile_parse_primary");
         return ERR;
     } else if (token_iseqstr(*token_itr, "(")) {
         (*token_itr)++;
-        if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse expression in compile_parse_primary");
             return ERR;
         }
@@ -274,54 +546,66 @@ result_t compile_parse_primary(token_t** token_itr, node_t** node_itr, int64_t*
             return ERR;
         }
         (*token_itr)++;
-    } else if (token_iseqstr(*token_itr, "_read") || token_iseqstr(*token_itr, "_write") || token_iseqstr(*token_itr, "_usleep")) {
-        token_t* token = (*token_itr)++;
-        if (compile_parse_primary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
-            puts("Error: Failed to parse primary in compile_parse_primary (_read, _write, _usleep)");
+    } else if (builtin_find(*token_itr) != NULL) {
+        builtin_t* fn = builtin_find((*token_itr)++);
+        if (token_iseqstr(*token_itr, "(") && token_iseqstr(*token_itr + 1, ")")) {
+            *token_itr += 2;
+        } else if (compile_parse_primary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            puts("Error: Failed to parse primary in compile_parse_primary (builtin)");
             return ERR;
         }
-        if (token_iseqstr(token, "_read")) {
-            *((*node_itr)++) = (node_t){.type = TY_INST_READ, .token = NULL, .val = 0};
-        } else if (token_iseqstr(token, "_write")) {
-            *((*node_itr)++) = (node_t){.type = TY_INST_WRITE, .token = NULL, .val = 0};
-        } else if (token_iseqstr(token, "_usleep")) {
-            *((*node_itr)++) = (node_t){.type = TY_INST_USLEEP, .token = NULL, .val = 0};
-        }
+        *((*node_itr)++) = (node_t){.type = fn->type, .token = NULL, .val = 0};
     } else if (token_iseqstr(*token_itr, "if")) {
+        token_t* token_if = (*token_itr)++;
         int64_t label_if = (*map_cnt)++;
         int64_t label_else = (*map_cnt)++;
-        (*token_itr)++;
-        if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        pgo_site_t* site = pgo_find(vm, token_if);
+        bool_t isthencold = site != NULL && site->cnt[FALSE] > site->cnt[TRUE];
+        bool_t iselsecold = site != NULL && site->cnt[TRUE] > site->cnt[FALSE];
+        if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse expression in compile_parse_primary (if)");
             return ERR;
         }
-        *((*node_itr)++) = (node_t){.type = TY_INST_JZ, .token = NULL, .val = label_if};
-        if (compile_parse_stat(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        *((*node_itr)++) = (node_t){.type = isthencold ? TY_INST_JNZ : TY_INST_JZ, .token = token_if, .val = label_if};
+        if (isthencold) {
+            compile_parse_cold_open(node_itr, label_if);
+        }
+        if (compile_parse_stat(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse statement in compile_parse_primary (if)");
             return ERR;
         }
+        if (isthencold) {
+            compile_parse_cold_close(node_itr, label_else);
+        }
         if (token_iseqstr(*token_itr, "else")) {
             (*token_itr)++;
-            *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_else};
-            *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_if};
-            if (compile_parse_stat(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (iselsecold) {
+                compile_parse_cold_open(node_itr, label_if);
+            } else if (!isthencold) {
+                *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_else};
+                *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_if};
+            }
+            if (compile_parse_stat(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse statement in compile_parse_primary (else)");
                 return ERR;
             }
+            if (iselsecold) {
+                compile_parse_cold_close(node_itr, label_else);
+            }
             *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_else};
         } else {
-            *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_if};
+            *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = isthencold ? label_else : label_if};
         }
     } else if (token_iseqstr(*token_itr, "loop")) {
+        token_t* token_loop = (*token_itr)++;
         int64_t label_start = (*map_cnt)++;
         int64_t label_end = (*map_cnt)++;
-        (*token_itr)++;
         *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_start};
-        if (compile_parse_stat(token_itr, node_itr, map_cnt, label_start, label_end) == ERR) {
+        if (compile_parse_stat(vm, token_itr, node_itr, map_cnt, label_start, label_end) == ERR) {
             puts("Error: Failed to parse statement in compile_parse_primary (loop)");
             return ERR;
         }
-        *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_start};
+        *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = token_loop, .val = label_start};
         *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = NULL, .val = label_end};
     } else if (token_isnum(*token_itr)) {
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_CONST, .token = *token_itr, .val = token_toint(*token_itr)};
@@ -336,12 +620,12 @@ result_t compile_parse_primary(token_t** token_itr, node_t** node_itr, int64_t*
     return OK;
 }
 
-result_t compile_parse_postfix(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if ((map_find(*token_itr, *map_cnt) != map_end(*map_cnt)) && token_iseqstr(*token_itr + 1, "(")) {
+result_t compile_parse_postfix(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if ((map_find(vm, *token_itr, *map_cnt) != map_end(vm, *map_cnt)) && token_iseqstr(*token_itr + 1, "(")) {
         token_t* fn_name = *token_itr;
         *token_itr += 2;
         if (!token_iseqstr(*token_itr, ")")) {
-            if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse expression in compile_parse_postfix (call)");
                 return ERR;
             }
@@ -353,7 +637,7 @@ result_t compile_parse_postfix(token_t** token_itr, node_t** node_itr, int64_t*
         (*token_itr)++;
         *((*node_itr)++) = (node_t){.type = TY_INST_CALL, .token = fn_name, .val = 0};
     } else {
-        if (compile_parse_primary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_primary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse primary in compile_parse_postfix");
             return ERR;
         }
@@ -361,38 +645,52 @@ result_t compile_parse_postfix(token_t** token_itr, node_t** node_itr, int64_t*
     return OK;
 }
 
-result_t compile_parse_unary(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+result_t compile_parse_unary(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
     if (token_iseqstr(*token_itr, "*")) {
         (*token_itr)++;
-        if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse unary in compile_parse_unary (deref)");
             return ERR;
         }
         *((*node_itr)++) = (node_t){.type = TY_INST_DEREF, .token = NULL, .val = 0};
+    } else if (token_iseqstr(*token_itr, ".")) {
+        (*token_itr)++;
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            puts("Error: Failed to parse unary in compile_parse_unary (deref8)");
+            return ERR;
+        }
+        *((*node_itr)++) = (node_t){.type = TY_INST_DEREF8, .token = NULL, .val = 0};
+    } else if (token_iseqstr(*token_itr, ":")) {
+        (*token_itr)++;
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            puts("Error: Failed to parse unary in compile_parse_unary (deref32)");
+            return ERR;
+        }
+        *((*node_itr)++) = (node_t){.type = TY_INST_DEREF32, .token = NULL, .val = 0};
     } else if (token_iseqstr(*token_itr, "+")) {
         (*token_itr)++;
-        if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse unary in compile_parse_unary (plus)");
             return ERR;
         }
     } else if (token_iseqstr(*token_itr, "-")) {
         (*token_itr)++;
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_CONST, .token = NULL, .val = 0};
-        if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse unary in compile_parse_unary (minus)");
             return ERR;
         }
         *((*node_itr)++) = (node_t){.type = TY_INST_SUB, .token = NULL, .val = 0};
     } else if (token_iseqstr(*token_itr, "~")) {
         (*token_itr)++;
-        if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse unary in compile_parse_unary (bitnot)");
             return ERR;
         }
         *((*node_itr)++) = (node_t){.type = TY_INST_BITNOT, .token = NULL, .val = 0};
     } else if (token_iseqstr(*token_itr, "!")) {
         (*token_itr)++;
-        if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse unary in compile_parse_unary (not)");
             return ERR;
         }
@@ -402,7 +700,7 @@ result_t compile_parse_unary(token_t** token_itr, node_t** node_itr, int64_t* ma
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_LOCAL_ADDR, .token = *token_itr, .val = 0};
         (*token_itr)++;
     } else {
-        if (compile_parse_postfix(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_postfix(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse postfix in compile_parse_unary");
             return ERR;
         }
@@ -410,29 +708,29 @@ result_t compile_parse_unary(token_t** token_itr, node_t** node_itr, int64_t* ma
     return OK;
 }
 
-result_t compile_parse_mul(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_mul(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse unary in compile_parse_mul");
         return ERR;
     }
     while (1) {
         if (token_iseqstr(*token_itr, "*")) {
             (*token_itr)++;
-            if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse unary in compile_parse_mul (mul)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_MUL, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, "/")) {
             (*token_itr)++;
-            if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse unary in compile_parse_mul (div)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_DIV, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, "%")) {
             (*token_itr)++;
-            if (compile_parse_unary(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_unary(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse unary in compile_parse_mul (mod)");
                 return ERR;
             }
@@ -443,22 +741,22 @@ result_t compile_parse_mul(token_t** token_itr, node_t** node_itr, int64_t* map_
     }
 }
 
-result_t compile_parse_add(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_mul(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_add(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_mul(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse mul in compile_parse_add");
         return ERR;
     }
     while (1) {
         if (token_iseqstr(*token_itr, "+")) {
             (*token_itr)++;
-            if (compile_parse_mul(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_mul(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse mul in compile_parse_add (add)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_ADD, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, "-")) {
             (*token_itr)++;
-            if (compile_parse_mul(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_mul(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse mul in compile_parse_add (sub)");
                 return ERR;
             }
@@ -469,22 +767,22 @@ result_t compile_parse_add(token_t** token_itr, node_t** node_itr, int64_t* map_
     }
 }
 
-result_t compile_parse_shift(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_add(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_shift(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_add(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse add in compile_parse_shift");
         return ERR;
     }
     while (1) {
         if (token_iseqstr(*token_itr, "<<")) {
             (*token_itr)++;
-            if (compile_parse_add(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_add(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse add in compile_parse_shift (shl)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_SHL, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, ">>")) {
             (*token_itr)++;
-            if (compile_parse_add(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_add(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse add in compile_parse_shift (shr)");
                 return ERR;
             }
@@ -495,36 +793,36 @@ result_t compile_parse_shift(token_t** token_itr, node_t** node_itr, int64_t* ma
     }
 }
 
-result_t compile_parse_rel(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_shift(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_rel(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_shift(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse shift in compile_parse_rel");
         return ERR;
     }
     while (1) {
         if (token_iseqstr(*token_itr, "<")) {
             (*token_itr)++;
-            if (compile_parse_shift(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_shift(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse shift in compile_parse_rel (lt)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_LT, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, ">")) {
             (*token_itr)++;
-            if (compile_parse_shift(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_shift(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse shift in compile_parse_rel (gt)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_GT, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, "<=")) {
             (*token_itr)++;
-            if (compile_parse_shift(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_shift(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse shift in compile_parse_rel (le)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_LE, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, ">=")) {
             (*token_itr)++;
-            if (compile_parse_shift(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_shift(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse shift in compile_parse_rel (ge)");
                 return ERR;
             }
@@ -535,22 +833,22 @@ result_t compile_parse_rel(token_t** token_itr, node_t** node_itr, int64_t* map_
     }
 }
 
-result_t compile_parse_eq(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_rel(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_eq(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_rel(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse rel in compile_parse_eq");
         return ERR;
     }
     while (1) {
         if (token_iseqstr(*token_itr, "==")) {
             (*token_itr)++;
-            if (compile_parse_rel(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_rel(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse rel in compile_parse_eq (eq)");
                 return ERR;
             }
             *((*node_itr)++) = (node_t){.type = TY_INST_EQ, .token = NULL, .val = 0};
         } else if (token_iseqstr(*token_itr, "!=")) {
             (*token_itr)++;
-            if (compile_parse_rel(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_rel(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 puts("Error: Failed to parse rel in compile_parse_eq (ne)");
                 return ERR;
             }
@@ -561,14 +859,14 @@ result_t compile_parse_eq(token_t** token_itr, node_t** node_itr, int64_t* map_c
     }
 }
 
-result_t compile_parse_bit_and(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_eq(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_bit_and(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_eq(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse eq in compile_parse_bit_and");
         return ERR;
     }
     while (token_iseqstr(*token_itr, "&")) {
         (*token_itr)++;
-        if (compile_parse_eq(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_eq(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse eq in compile_parse_bit_and (bitand)");
             return ERR;
         }
@@ -577,14 +875,14 @@ result_t compile_parse_bit_and(token_t** token_itr, node_t** node_itr, int64_t*
     return OK;
 }
 
-result_t compile_parse_bit_xor(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_bit_and(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_bit_xor(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_bit_and(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse bit_and in compile_parse_bit_xor");
         return ERR;
     }
     while (token_iseqstr(*token_itr, "^")) {
         (*token_itr)++;
-        if (compile_parse_bit_and(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_bit_and(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse bit_and in compile_parse_bit_xor (bitxor)");
             return ERR;
         }
@@ -593,14 +891,14 @@ result_t compile_parse_bit_xor(token_t** token_itr, node_t** node_itr, int64_t*
     return OK;
 }
 
-result_t compile_parse_bit_or(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_bit_xor(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_bit_or(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_bit_xor(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse bit_xor in compile_parse_bit_or");
         return ERR;
     }
     while (token_iseqstr(*token_itr, "|")) {
         (*token_itr)++;
-        if (compile_parse_bit_xor(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_bit_xor(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse bit_xor in compile_parse_bit_or (bitor)");
             return ERR;
         }
@@ -609,14 +907,14 @@ result_t compile_parse_bit_or(token_t** token_itr, node_t** node_itr, int64_t* m
     return OK;
 }
 
-result_t compile_parse_and(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_bit_or(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_and(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_bit_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse bit_or in compile_parse_and");
         return ERR;
     }
     while (token_iseqstr(*token_itr, "&&")) {
         (*token_itr)++;
-        if (compile_parse_bit_or(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_bit_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse bit_or in compile_parse_and (and)");
             return ERR;
         }
@@ -625,14 +923,14 @@ result_t compile_parse_and(token_t** token_itr, node_t** node_itr, int64_t* map_
     return OK;
 }
 
-result_t compile_parse_or(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_and(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_or(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_and(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse and in compile_parse_or");
         return ERR;
     }
     while (token_iseqstr(*token_itr, "||")) {
         (*token_itr)++;
-        if (compile_parse_and(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_and(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse and in compile_parse_or (or)");
             return ERR;
         }
@@ -641,30 +939,46 @@ result_t compile_parse_or(token_t** token_itr, node_t** node_itr, int64_t* map_c
     return OK;
 }
 
-result_t compile_parse_assign(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_or(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_assign(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    node_t* lhs = *node_itr;
+    if (compile_parse_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse or in compile_parse_assign");
         return ERR;
     }
     if (token_iseqstr(*token_itr, "=")) {
+        bool_t islocal = *node_itr - lhs == 1 && lhs->type == TY_INST_PUSH_LOCAL_ADDR;
         (*token_itr)++;
-        if (compile_parse_or(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse or in compile_parse_assign (assign)");
             return ERR;
         }
-        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN1, .token = NULL, .val = 0};
+        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN1, .token = NULL, .val = islocal};
+    } else if (token_iseqstr(*token_itr, ".=")) {
+        (*token_itr)++;
+        if (compile_parse_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            puts("Error: Failed to parse or in compile_parse_assign (assign8)");
+            return ERR;
+        }
+        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN2, .token = NULL, .val = 0};
+    } else if (token_iseqstr(*token_itr, ":=")) {
+        (*token_itr)++;
+        if (compile_parse_or(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            puts("Error: Failed to parse or in compile_parse_assign (assign32)");
+            return ERR;
+        }
+        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN3, .token = NULL, .val = 0};
     }
     return OK;
 }
 
-result_t compile_parse_expr(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
-    if (compile_parse_assign(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+result_t compile_parse_expr(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    if (compile_parse_assign(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         puts("Error: Failed to parse assign in compile_parse_expr");
         return ERR;
     }
     while (token_iseqstr(*token_itr, ",")) {
         (*token_itr)++;
-        if (compile_parse_assign(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_assign(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             puts("Error: Failed to parse assign in compile_parse_expr (comma)");
             return ERR;
         }
@@ -672,13 +986,13 @@ result_t compile_parse_expr(token_t** token_itr, node_t** node_itr, int64_t* map
     return OK;
 }
 
-result_t compile_parse_stat(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+result_t compile_parse_stat(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
     compile_parse_skiplinebreak(token_itr);
     if (token_iseqstr(*token_itr, "{")) {
         (*token_itr)++;
         compile_parse_skiplinebreak(token_itr);
         while (!token_iseqstr(*token_itr, "}")) {
-            if (compile_parse_stat(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+            if (compile_parse_stat(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
                 return ERR;
             }
             compile_parse_skiplinebreak(token_itr);
@@ -689,30 +1003,34 @@ result_t compile_parse_stat(token_t** token_itr, node_t** node_itr, int64_t* map
         *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_continue};
     } else if (token_iseqstr(*token_itr, "break")) {
         (*token_itr)++;
-        if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             return ERR;
         }
         *((*node_itr)++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = label_break};
     } else if (token_iseqstr(*token_itr, "return")) {
         (*token_itr)++;
-        if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             return ERR;
         }
         *((*node_itr)++) = (node_t){.type = TY_INST_RETURN, .token = NULL, .val = 0};
     } else {
-        if (compile_parse_expr(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+        if (compile_parse_expr(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
             return ERR;
         }
     }
     return OK;
 }
 
-result_t compile_parse_fn(token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+result_t compile_parse_fn(vm_t* vm, token_t** token_itr, node_t** node_itr, int64_t* map_cnt, int64_t label_continue, int64_t label_break) {
+    bool_t ismemo = token_iseqstr(*token_itr, "memo");
+    if (ismemo) {
+        (*token_itr)++;
+    }
     token_t* fn_name = *token_itr + 1;
-    pair_t* fn_map = map_find(fn_name, *map_cnt);
+    pair_t* fn_map = map_find(vm, fn_name, *map_cnt);
     int64_t arg_cnt = 0;
 
-    if (fn_map == map_end(*map_cnt)) {
+    if (fn_map == map_end(vm, *map_cnt)) {
         return ERR;
     }
 
@@ -736,16 +1054,24 @@ result_t compile_parse_fn(token_t** token_itr, node_t** node_itr, int64_t* map_c
         arg_itr--;
     }
 
-    *((*node_itr)++) = (node_t){.type = TY_LABEL_SCOPE_OPEN, .token = NULL, .val = 0};
-    *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = fn_name, .val = fn_map - mem.compile.map};
+    if (ismemo && arg_cnt > MEMO_ARG_MAX) {
+        puts("Error: Too many arguments for memo function in compile_parse_fn");
+        return ERR;
+    }
+
+    *((*node_itr)++) = (node_t){.type = TY_LABEL_SCOPE_OPEN, .token = fn_name, .val = ismemo ? arg_cnt + 1 : 0};
+    *((*node_itr)++) = (node_t){.type = TY_LABEL, .token = fn_name, .val = fn_map - vm->mem->compile.map};
     if (arg_cnt > 0) {
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_LOCAL_ADDR, .token = NULL, .val = -2};
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_LOCAL_VAL, .token = NULL, .val = -2};
         *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_CONST, .token = NULL, .val = arg_cnt};
         *((*node_itr)++) = (node_t){.type = TY_INST_SUB, .token = NULL, .val = 0};
-        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN1, .token = NULL, .val = 0};
+        *((*node_itr)++) = (node_t){.type = TY_INST_ASSIGN1, .token = NULL, .val = TRUE};
     }
-    if (compile_parse_stat(token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
+    if (ismemo) {
+        *((*node_itr)++) = (node_t){.type = TY_INST_MEMO_ENTER, .token = NULL, .val = arg_cnt};
+    }
+    if (compile_parse_stat(vm, token_itr, node_itr, map_cnt, label_continue, label_break) == ERR) {
         return ERR;
     }
     *((*node_itr)++) = (node_t){.type = TY_INST_PUSH_CONST, .token = NULL, .val = 0};
@@ -754,28 +1080,28 @@ result_t compile_parse_fn(token_t** token_itr, node_t** node_itr, int64_t* map_c
     return OK;
 }
 
-result_t compile_parse(int64_t* map_cnt) {
+result_t compile_parse(vm_t* vm, int64_t* map_cnt) {
     int64_t firstjmp = (*map_cnt)++;
-    token_t* token_itr = mem.compile.token;
-    node_t* node_itr = mem.compile.node;
+    token_t* token_itr = vm->mem->compile.token;
+    node_t* node_itr = vm->mem->compile.node;
     *(node_itr++) = (node_t){.type = TY_INST_JMP, .token = NULL, .val = firstjmp};
     while (token_itr->data != NULL) {
         if (token_iseqstr(token_itr, "fn")) {
-            mem.compile.map[(*map_cnt)++] = (pair_t){.key = token_itr + 1, .val = 0};
+            vm->mem->compile.map[(*map_cnt)++] = (pair_t){.key = token_itr + 1, .val = 0};
         }
         token_itr++;
     }
-    token_itr = mem.compile.token;
+    token_itr = vm->mem->compile.token;
     compile_parse_skiplinebreak(&token_itr);
-    while (token_iseqstr(token_itr, "fn")) {
-        if (compile_parse_fn(&token_itr, &node_itr, map_cnt, -1, -1) == ERR) {
+    while (token_iseqstr(token_itr, "fn") || token_iseqstr(token_itr, "memo")) {
+        if (compile_parse_fn(vm, &token_itr, &node_itr, map_cnt, -1, -1) == ERR) {
             return ERR;
         }
         compile_parse_skiplinebreak(&token_itr);
     }
     *(node_itr++) = (node_t){.type = TY_LABEL, .token = NULL, .val = firstjmp};
     while (token_itr->data != NULL) {
-        if (compile_parse_stat(&token_itr, &node_itr, map_cnt, -1, -1) == ERR) {
+        if (compile_parse_stat(vm, &token_itr, &node_itr, map_cnt, -1, -1) == ERR) {
             return ERR;
         }
         compile_parse_skiplinebreak(&token_itr);
@@ -785,298 +1111,2898 @@ result_t compile_parse(int64_t* map_cnt) {
     return OK;
 }
 
-result_t compile_analyze(int64_t* map_cnt) {
+node_t* compile_layout_skip(node_t* node_itr) {
+    int64_t depth = 0;
+    do {
+        depth += node_itr->type == TY_LABEL_COLD_OPEN;
+        depth -= node_itr->type == TY_LABEL_COLD_CLOSE;
+        node_itr++;
+    } while (depth > 0);
+    return node_itr;
+}
+
+// Copies [begin, end) to out with every cold block left out, then appends each cold block the same way.
+node_t* compile_layout_range(node_t* begin, node_t* end, node_t* out) {
+    for (node_t* node_itr = begin; node_itr < end;) {
+        if (node_itr->type == TY_LABEL_COLD_OPEN) {
+            node_itr = compile_layout_skip(node_itr);
+        } else {
+            *(out++) = *(node_itr++);
+        }
+    }
+    for (node_t* node_itr = begin; node_itr < end;) {
+        if (node_itr->type == TY_LABEL_COLD_OPEN) {
+            node_t* next = compile_layout_skip(node_itr);
+            out = compile_layout_range(node_itr + 1, next - 1, out);
+            node_itr = next;
+        } else {
+            node_itr++;
+        }
+    }
+    return out;
+}
+
+// Moves the cold blocks the parser bracketed behind the last RETURN of their function, or behind the top-level END,
+// so the hot path of every profiled if falls through. The node list is staged in the still unused bin area, which the
+// globals and the stack expect zeroed again afterwards.
+result_t compile_layout(vm_t* vm) {
+    if (vm->pgo_use == NULL || !vm->pgo_use->ismatch) {
+        return OK;
+    }
+    node_t* node = vm->mem->compile.node;
+    node_t* stage = (node_t*)vm->mem->compile.bin;
+    int64_t node_cnt = 0;
+    while (node[node_cnt].type != TY_NULL) {
+        node_cnt++;
+    }
+    __builtin_memcpy(stage, node, (node_cnt + 1) * sizeof(node_t));
+    node_t* out = node;
+    node_t* begin = stage;
+    for (node_t* node_itr = stage; node_itr < stage + node_cnt; node_itr++) {
+        if (node_itr->type == TY_LABEL_SCOPE_OPEN || node_itr->type == TY_LABEL_SCOPE_CLOSE) {
+            out = compile_layout_range(begin, node_itr, out);
+            begin = node_itr;
+        }
+    }
+    out = compile_layout_range(begin, stage + node_cnt, out);
+    *out = (node_t){.type = TY_NULL, .token = NULL, .val = 0};
+    __builtin_memset(stage, 0, (node_cnt + 1) * sizeof(node_t));
+    return OK;
+}
+
+result_t compile_analyze(vm_t* vm, int64_t* map_cnt) {
     int64_t map_base = *map_cnt;
-    node_t* node_itr = mem.compile.node;
+    node_t* node_itr = vm->mem->compile.node;
     int64_t offset = 0;
+    int64_t memo_argc = -1;
 
     while (node_itr->type != TY_NULL) {
         if ((node_itr->type == TY_INST_PUSH_LOCAL_VAL || node_itr->type == TY_INST_PUSH_LOCAL_ADDR) && node_itr->token != NULL) {
-            pair_t* map_result = map_find(node_itr->token, *map_cnt);
-            if (map_result == map_end(*map_cnt)) {
+            pair_t* map_result = map_find(vm, node_itr->token, *map_cnt);
+            if (node_itr->type == TY_INST_PUSH_LOCAL_ADDR && map_result - vm->mem->compile.map < map_base) {
+                *node_itr = (node_t){.type = TY_INST_PUSH_FN, .token = node_itr->token, .val = map_result - vm->mem->compile.map};
+                node_itr++;
+                continue;
+            }
+            if (map_result == map_end(vm, *map_cnt)) {
                 if (node_itr->val != 0) {
-                    mem.compile.map[(*map_cnt)++] = (pair_t){.key = node_itr->token, .val = node_itr->val};
+                    vm->mem->compile.map[(*map_cnt)++] = (pair_t){.key = node_itr->token, .val = node_itr->val};
                 } else {
-                    mem.compile.map[(*map_cnt)++] = (pair_t){.key = node_itr->token, .val = offset++};
+                    vm->mem->compile.map[(*map_cnt)++] = (pair_t){.key = node_itr->token, .val = offset++};
                 }
             }
             node_itr->val = map_result->val;
         } else if (node_itr->type == TY_INST_CALL) {
-            pair_t* map_result = map_find(node_itr->token, *map_cnt);
-            if (map_result == map_end(*map_cnt)) {
+            pair_t* map_result = map_find(vm, node_itr->token, *map_cnt);
+            if (map_result == map_end(vm, *map_cnt)) {
                 return ERR;
             }
-            node_itr->val = map_result - mem.compile.map;
+            node_itr->val = map_result - vm->mem->compile.map;
+        } else if (node_itr->type == TY_LABEL_SCOPE_OPEN) {
+            offset = node_itr->val;
+            memo_argc = node_itr->val - 1;
+        } else if (node_itr->type == TY_INST_RETURN && memo_argc >= 0) {
+            *node_itr = (node_t){.type = TY_INST_MEMO_RETURN, .token = NULL, .val = memo_argc};
         } else if (node_itr->type == TY_LABEL_SCOPE_CLOSE) {
             (*map_cnt) = map_base;
             offset = 0;
+            memo_argc = -1;
         }
         node_itr++;
     }
     return OK;
 }
 
-result_t compile_tobin() {
-    int64_t* bin_base = mem.compile.bin + MEM_GLOBAL_SIZE;
-    node_t* node_itr = mem.compile.node;
-    int64_t* bin_itr = bin_base;
+bool_t compile_purity_isimpure(node_t* node) {
+    if (node->type == TY_INST_DEREF || node->type == TY_INST_DEREF8 || node->type == TY_INST_DEREF32) {
+        return node->type != TY_INST_DEREF || (node - 1)->type != TY_INST_PUSH_LOCAL_ADDR;
+    }
+    if (node->type == TY_INST_ASSIGN1) {
+        return node->val == FALSE;
+    }
+    if (node->type == TY_INST_ASSIGN2 || node->type == TY_INST_ASSIGN3 || node->type == TY_INST_ASSIGN4) {
+        return TRUE;
+    }
+    for (builtin_t* itr = builtin; itr->name != NULL; itr++) {
+        if (node->type == itr->type) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// A function is pure when it only touches its own frame, does no I/O and calls only pure functions.
+// The verdict is kept in the function's map entry until compile_tobin overwrites it with the address.
+result_t compile_purity(vm_t* vm) {
+    node_t* fn_begin = NULL;
+    for (node_t* node_itr = vm->mem->compile.node; node_itr->type != TY_NULL; node_itr++) {
+        if (node_itr->type == TY_LABEL_SCOPE_OPEN) {
+            fn_begin = node_itr;
+            vm->mem->compile.map[(node_itr + 1)->val].val = TRUE;
+        } else if (fn_begin != NULL && compile_purity_isimpure(node_itr)) {
+            vm->mem->compile.map[(fn_begin + 1)->val].val = FALSE;
+        } else if (node_itr->type == TY_LABEL_SCOPE_CLOSE) {
+            fn_begin = NULL;
+        }
+    }
+    bool_t ischanged = TRUE;
+    while (ischanged) {
+        ischanged = FALSE;
+        for (node_t* node_itr = vm->mem->compile.node; node_itr->type != TY_NULL; node_itr++) {
+            if (node_itr->type == TY_LABEL_SCOPE_OPEN) {
+                fn_begin = node_itr;
+            } else if (node_itr->type == TY_INST_CALL && fn_begin != NULL) {
+                pair_t* fn = &vm->mem->compile.map[(fn_begin + 1)->val];
+                if (fn->val == TRUE && vm->mem->compile.map[node_itr->val].val == FALSE) {
+                    fn->val = FALSE;
+                    ischanged = TRUE;
+                }
+            } else if (node_itr->type == TY_LABEL_SCOPE_CLOSE) {
+                fn_begin = NULL;
+            }
+        }
+    }
+    for (node_t* node_itr = vm->mem->compile.node; node_itr->type != TY_NULL; node_itr++) {
+        if (node_itr->type == TY_LABEL_SCOPE_OPEN && node_itr->val != 0 && vm->mem->compile.map[(node_itr + 1)->val].val == FALSE) {
+            printf("Error: memo function '%.*s' is not pure\n", (int)node_itr->token->size, node_itr->token->data);
+            return ERR;
+        }
+    }
+    return OK;
+}
+
+// Moves line_itr to token and keeps line counting the newlines passed, in either direction.
+int64_t compile_tobin_line(vm_t* vm, token_t* token, const char** line_itr, int64_t line) {
+    const char* src = vm->mem->compile.src;
+    if (token == NULL || token->data < src || src + sizeof(vm->mem->compile.src) <= token->data) {
+        return line;
+    }
+    for (; *line_itr < token->data; (*line_itr)++) {
+        line += **line_itr == '\n';
+    }
+    for (; token->data < *line_itr; (*line_itr)--) {
+        line -= *(*line_itr - 1) == '\n';
+    }
+    return line;
+}
+
+// Operands are little-endian immediates: constants and frame offsets take the narrowest opcode variant that holds them,
+// memo argument counts one byte, and jump, call and function targets a 32-bit absolute code address.
+operand_t code_operand(int64_t type) {
+    if (type == TY_INST_PUSH_CONST8 || type == TY_INST_PUSH_LOCAL_VAL8 || type == TY_INST_PUSH_LOCAL_ADDR8 || type == TY_INST_MEMO_ENTER || type == TY_INST_MEMO_RETURN) {
+        return OPERAND_I8;
+    }
+    if (type == TY_INST_PUSH_CONST32 || type == TY_INST_PUSH_LOCAL_VAL || type == TY_INST_PUSH_LOCAL_ADDR) {
+        return OPERAND_I32;
+    }
+    if (type == TY_INST_PUSH_CONST) {
+        return OPERAND_I64;
+    }
+    if (type == TY_INST_PUSH_FN || type == TY_INST_JMP || type == TY_INST_JZ || type == TY_INST_JNZ || type == TY_INST_CALL) {
+        return OPERAND_LABEL;
+    }
+    return OPERAND_NONE;
+}
+
+int64_t code_operand_size(operand_t operand) {
+    if (operand == OPERAND_I8) {
+        return sizeof(int8_t);
+    }
+    if (operand == OPERAND_I64) {
+        return sizeof(int64_t);
+    }
+    return operand == OPERAND_NONE ? 0 : CODE_LABEL_SIZE;
+}
+
+type_t code_narrow(type_t type, int64_t val) {
+    bool_t isi8 = INT8_MIN <= val && val <= INT8_MAX;
+    if (type == TY_INST_PUSH_CONST) {
+        return isi8 ? TY_INST_PUSH_CONST8 : INT32_MIN <= val && val <= INT32_MAX ? TY_INST_PUSH_CONST32 : TY_INST_PUSH_CONST;
+    }
+    if (type == TY_INST_PUSH_LOCAL_VAL && isi8) {
+        return TY_INST_PUSH_LOCAL_VAL8;
+    }
+    if (type == TY_INST_PUSH_LOCAL_ADDR && isi8) {
+        return TY_INST_PUSH_LOCAL_ADDR8;
+    }
+    return type;
+}
+
+int64_t code_put(uint8_t* code, int64_t at, int64_t val, int64_t size) {
+    __builtin_memcpy(code + at, &val, size);
+    return at + size;
+}
+
+__attribute__((always_inline)) static inline int64_t code_i32(const uint8_t* code, int64_t at) {
+    int32_t val;
+    __builtin_memcpy(&val, code + at, sizeof(int32_t));
+    return val;
+}
+
+__attribute__((always_inline)) static inline int64_t code_i64(const uint8_t* code, int64_t at) {
+    int64_t val;
+    __builtin_memcpy(&val, code + at, sizeof(int64_t));
+    return val;
+}
+
+__attribute__((always_inline)) static inline int64_t code_label(const uint8_t* code, int64_t at) {
+    uint32_t addr;
+    __builtin_memcpy(&addr, code + at, sizeof(uint32_t));
+    return addr;
+}
+
+// Emits one opcode byte per instruction plus its operand, so code addresses (ip, labels) are byte offsets into mem.bin.
+// Besides the bytecode, records a debug entry wherever the source line or the enclosing function changes.
+result_t compile_tobin(vm_t* vm) {
+    uint8_t* code = (uint8_t*)vm->mem->compile.bin;
+    node_t* node_itr = vm->mem->compile.node;
+    int64_t code_itr = CODE_ADDR(MEM_GLOBAL_SIZE);
+    const char* line_itr = vm->mem->compile.src;
+    int64_t line = 1;
+    int64_t fn = -1;
+    vm->debug_cnt = 0;
+    vm->fn_end = 0;
+    if (vm->pgo != NULL) {
+        vm->pgo->site_cnt = 0;
+    }
     while (node_itr->type != TY_NULL) {
         if (node_itr->type == TY_LABEL) {
-            mem.compile.map[node_itr->val].val = bin_itr - mem.compile.bin;
-        } else if (node_itr->type == TY_INST_PUSH_CONST || node_itr->type == TY_INST_PUSH_LOCAL_VAL || node_itr->type == TY_INST_PUSH_LOCAL_ADDR) {
-            *(bin_itr++) = node_itr->type;
-            *(bin_itr++) = node_itr->val;
-        } else if (node_itr->type == TY_INST_JMP || node_itr->type == TY_INST_JZ || node_itr->type == TY_INST_CALL) {
-            *(bin_itr++) = node_itr->type;
-            *(bin_itr++) = node_itr->val;
+            vm->mem->compile.map[node_itr->val].val = code_itr;
+        } else if (node_itr->type == TY_LABEL_SCOPE_OPEN) {
+            fn = code_itr;
+        } else if (node_itr->type == TY_LABEL_SCOPE_CLOSE) {
+            fn = -1;
+            vm->fn_end = code_itr;
         } else {
-            if (node_itr->type != TY_LABEL_SCOPE_OPEN && node_itr->type != TY_LABEL_SCOPE_CLOSE) {
-                *(bin_itr++) = node_itr->type;
+            line = compile_tobin_line(vm, node_itr->token, &line_itr, line);
+            debug_t* last = vm->debug_cnt == 0 ? NULL : &vm->debug[vm->debug_cnt - 1];
+            if (last == NULL || last->line != line || last->fn != fn) {
+                vm->debug[vm->debug_cnt++] = (debug_t){.addr = code_itr, .line = line, .fn = fn};
             }
+            type_t type = code_narrow(node_itr->type, node_itr->val);
+            pgo_mark(vm, node_itr, type, code_itr);
+            code[code_itr++] = type;
+            code_itr = code_put(code, code_itr, node_itr->val, code_operand_size(code_operand(type)));
         }
         node_itr++;
     }
-    mem.bin[GLOBALADDR_IP] = MEM_GLOBAL_SIZE;
-    mem.bin[GLOBALADDR_BP] = bin_itr - mem.compile.bin;
-    mem.bin[GLOBALADDR_SP] = mem.bin[GLOBALADDR_BP] + MEM_STACK_SIZE;
+    code[code_itr] = TY_NULL;
+    vm->code_end = code_itr;
+    vm->ip = CODE_ADDR(MEM_GLOBAL_SIZE);
+    vm->bp = code_itr / sizeof(int64_t) + 1;
+    vm->sp = vm->bp + MEM_STACK_SIZE;
+    vm->call_base = vm->sp;
+    // A VM compiled again must not see the last run's heap or mappings: every global restarts from zero and the map
+    // window gets fresh anonymous pages in place of its files, coroutine stacks and touched pages.
+    if (mmap(&vm->mem->bin[MEM_SIZE / sizeof(int64_t)], MEM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        puts("Error: Failed to reset the map window in compile_tobin");
+        return ERR;
+    }
+    __builtin_memset(vm->mem->bin, 0, MEM_GLOBAL_SIZE * sizeof(int64_t));
+    vm->mem->bin[GLOBALADDR_HEAP_TOP] = MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE;
+    vm->mem->bin[GLOBALADDR_MAP_TOP] = MEM_SIZE / sizeof(int64_t);
+    vm->mem->bin[GLOBALADDR_CO_BASE] = (MEM_SIZE + MEM_MAP_SIZE) / sizeof(int64_t);
+    vm->mem->bin[GLOBALADDR_END] = TY_INST_END;
+    vm->mem->bin[GLOBALADDR_CO_EXIT] = TY_INST_CO_EXIT;
     return OK;
 }
 
-result_t compile_link() {
-    int64_t* bin_base = mem.compile.bin + MEM_GLOBAL_SIZE;
-    int64_t* bin_itr = bin_base;
-    while (*bin_itr != TY_NULL) {
-        if (*bin_itr == TY_INST_PUSH_CONST || *bin_itr == TY_INST_PUSH_LOCAL_VAL || *bin_itr == TY_INST_PUSH_LOCAL_ADDR) {
-            bin_itr += 2;
-        } else if (*bin_itr == TY_INST_JMP || *bin_itr == TY_INST_JZ || *bin_itr == TY_INST_CALL) {
-            *(bin_itr + 1) = mem.compile.map[*(bin_itr + 1)].val;
-            bin_itr += 2;
-        } else {
-            bin_itr += 1;
+result_t compile_link(vm_t* vm) {
+    uint8_t* code = (uint8_t*)vm->mem->compile.bin;
+    int64_t code_itr = CODE_ADDR(MEM_GLOBAL_SIZE);
+    while (code[code_itr] != TY_NULL) {
+        operand_t operand = code_operand(code[code_itr++]);
+        if (operand == OPERAND_LABEL) {
+            code_put(code, code_itr, vm->mem->compile.map[code_label(code, code_itr)].val, CODE_LABEL_SIZE);
         }
+        code_itr += code_operand_size(operand);
     }
     return OK;
 }
 
-result_t compile() {
-    int64_t map_cnt = 0;
-    if (compile_readsrc() == ERR) {
-        puts("Failed to readsrc");
+// Copies each function's name, address and parameter count out of compile_t, which the stack may overwrite later.
+result_t compile_symbol(vm_t* vm) {
+    vm->symbol_cnt = 0;
+    for (node_t* node_itr = vm->mem->compile.node; node_itr->type != TY_NULL; node_itr++) {
+        if (node_itr->type != TY_LABEL_SCOPE_OPEN || node_itr->token->size >= SYMBOL_NAME_MAX) {
+            continue;
+        }
+        if (vm->symbol_cnt == SYMBOL_MAX) {
+            puts("Error: Too many functions in compile_symbol");
+            return ERR;
+        }
+        symbol_t* symbol = &vm->symbol[vm->symbol_cnt++];
+        __builtin_memcpy(symbol->name, node_itr->token->data, node_itr->token->size);
+        symbol->name_size = node_itr->token->size;
+        symbol->addr = vm->mem->compile.map[(node_itr + 1)->val].val;
+        symbol->argc = 0;
+        for (node_t* arg_itr = node_itr - 1; arg_itr->type == TY_INST_PUSH_LOCAL_ADDR && arg_itr->val <= -4; arg_itr--) {
+            symbol->argc++;
+        }
+    }
+    return OK;
+}
+
+// Parameter count from the prologue compile_parse_fn emits (bin[bp - 2] -= argc, which drops the caller's arguments
+// on return), or 0 for a function without one.
+int64_t verify_argc(const uint8_t* code, int64_t addr) {
+    if (code[addr] != TY_INST_PUSH_LOCAL_ADDR8 || (int8_t)code[addr + 1] != -2 || code[addr + 2] != TY_INST_PUSH_LOCAL_VAL8 || (int8_t)code[addr + 3] != -2) {
+        return 0;
+    }
+    if (code[addr + 4] == TY_INST_PUSH_CONST8 && code[addr + 6] == TY_INST_SUB && code[addr + 7] == TY_INST_ASSIGN1) {
+        return (int8_t)code[addr + 5];
+    }
+    if (code[addr + 4] == TY_INST_PUSH_CONST32 && code[addr + 9] == TY_INST_SUB && code[addr + 10] == TY_INST_ASSIGN1) {
+        return code_i32(code, addr + 5);
+    }
+    return 0;
+}
+
+// Operand stack words the instruction at addr pops and pushes. A call pops the arguments its callee drops.
+void verify_effect(const uint8_t* code, int64_t addr, int64_t* pop, int64_t* push) {
+    type_t type = code[addr];
+    *pop = 0;
+    *push = 0;
+    if ((TY_INST_PUSH_CONST <= type && type <= TY_INST_PUSH_LOCAL_ADDR8) || type == TY_INST_YIELD || type == TY_INST_SNAPSHOT) {
+        *push = 1;
+    } else if (type == TY_INST_JZ || type == TY_INST_JNZ || type == TY_INST_RETURN || type == TY_INST_MEMO_RETURN) {
+        *pop = 1;
+    } else if (TY_INST_ASSIGN1 <= type && type <= TY_INST_ASSIGN4) {
+        *pop = 2;
+    } else if (type == TY_INST_NOT || (TY_INST_DEREF <= type && type <= TY_INST_BITNOT)) {
+        *pop = 1;
+        *push = 1;
+    } else if (TY_INST_OR <= type && type <= TY_INST_BITAND) {
+        *pop = 2;
+        *push = 1;
+    } else if (type == TY_INST_CALL) {
+        *pop = verify_argc(code, code_label(code, addr + 1));
+        *push = 1;
+    } else {
+        for (builtin_t* itr = builtin; itr->name != NULL; itr++) {
+            if (itr->type == type) {
+                *pop = itr->argc;
+                *push = 1;
+            }
+        }
+    }
+}
+
+int64_t verify_line(vm_t* vm, int64_t addr) {
+    int64_t line = 0;
+    for (int64_t i = 0; i < vm->debug_cnt && vm->debug[i].addr <= addr; i++) {
+        line = vm->debug[i].line;
+    }
+    return line;
+}
+
+// Scratch for compile_verify, one slot per code byte: the operand stack depth an instruction is reached with
+// (VERIFY_INST before any path reaches it, VERIFY_NONE inside an operand), the function that reaches it, plus a worklist.
+typedef struct {
+    int32_t* depth;
+    int32_t* owner;
+    uint8_t* queued;
+    int64_t* work;
+    int64_t work_cnt;
+    int64_t fn_cnt;
+    int64_t fn_addr[SYMBOL_MAX + 1];
+    int64_t fn_argc[SYMBOL_MAX + 1];
+    int64_t fn_max[SYMBOL_MAX + 1];
+    bool_t fn_isbalanced[SYMBOL_MAX + 1];
+} verify_t;
+
+#define VERIFY_NONE (-2)
+#define VERIFY_INST (-1)
+
+// Reaches at with the given depth from function fn; a lower depth than an earlier path queues it again, so the
+// recorded depth is the least any path leaves, and underflow is checked against that.
+result_t verify_reach(vm_t* vm, verify_t* verify, int64_t from, int64_t at, int64_t depth, int64_t fn) {
+    int64_t begin = CODE_ADDR(MEM_GLOBAL_SIZE);
+    if (at < begin || vm->code_end <= at || verify->depth[at - begin] == VERIFY_NONE) {
+        printf("Error: Jump to %" PRId64 " is not an instruction at line %" PRId64 " in compile_verify\n", at, verify_line(vm, from));
         return ERR;
     }
-    if (compile_tokenize() == ERR) {
-        puts("Failed to tokenize");
+    int64_t i = at - begin;
+    if (verify->owner[i] != 0 && verify->owner[i] != fn + 1) {
+        printf("Error: Code at %" PRId64 " is reached from two functions at line %" PRId64 " in compile_verify\n", at, verify_line(vm, from));
         return ERR;
     }
-    if (compile_parse(&map_cnt) == ERR) {
-        puts("Failed to parse");
+    if (verify->depth[i] != VERIFY_INST && verify->depth[i] != depth) {
+        verify->fn_isbalanced[fn] = FALSE;
+    }
+    if (verify->depth[i] != VERIFY_INST && verify->depth[i] <= depth) {
+        return OK;
+    }
+    verify->depth[i] = depth;
+    verify->owner[i] = fn + 1;
+    verify->fn_max[fn] = depth > verify->fn_max[fn] ? depth : verify->fn_max[fn];
+    if (!verify->queued[i]) {
+        verify->queued[i] = TRUE;
+        verify->work[verify->work_cnt++] = at;
+    }
+    return OK;
+}
+
+// Starts a function at addr with an empty operand stack; the first entry is the top-level code.
+result_t verify_entry(vm_t* vm, verify_t* verify, int64_t from, int64_t addr) {
+    int64_t begin = CODE_ADDR(MEM_GLOBAL_SIZE);
+    if (begin <= addr && addr < vm->code_end && verify->owner[addr - begin] != 0) {
+        return OK;
+    }
+    if (verify->fn_cnt == SYMBOL_MAX + 1) {
+        puts("Error: Too many functions in compile_verify");
         return ERR;
     }
-    if (compile_analyze(&map_cnt) == ERR) {
-        puts("Failed to analyze");
+    int64_t fn = verify->fn_cnt++;
+    verify->fn_addr[fn] = addr;
+    verify->fn_argc[fn] = fn == 0 ? 0 : verify_argc((uint8_t*)vm->mem->compile.bin, addr);
+    verify->fn_max[fn] = 0;
+    verify->fn_isbalanced[fn] = TRUE;
+    return verify_reach(vm, verify, from, addr, 0, fn);
+}
+
+// Checks one reached instruction against its function's frame and reaches its successors.
+result_t verify_inst(vm_t* vm, verify_t* verify, int64_t addr) {
+    uint8_t* code = (uint8_t*)vm->mem->compile.bin;
+    int64_t i = addr - CODE_ADDR(MEM_GLOBAL_SIZE);
+    int64_t fn = verify->owner[i] - 1;
+    int64_t argc = verify->fn_argc[fn];
+    bool_t istop = fn == 0;
+    type_t type = code[addr];
+    operand_t operand = code_operand(type);
+    int64_t next = addr + 1 + code_operand_size(operand);
+    if (type == TY_INST_PUSH_LOCAL_VAL || type == TY_INST_PUSH_LOCAL_ADDR || type == TY_INST_PUSH_LOCAL_VAL8 || type == TY_INST_PUSH_LOCAL_ADDR8) {
+        int64_t offset = operand == OPERAND_I8 ? (int8_t)code[addr + 1] : code_i32(code, addr + 1);
+        if (offset < (istop ? 0 : -3 - argc) || MEM_STACK_SIZE - 3 <= offset) {
+            printf("Error: Frame offset %" PRId64 " outside the frame at line %" PRId64 " in compile_verify\n", offset, verify_line(vm, addr));
+            return ERR;
+        }
+    } else if ((type == TY_INST_MEMO_ENTER || type == TY_INST_MEMO_RETURN) && (istop || code[addr + 1] != argc || MEMO_ARG_MAX < argc)) {
+        printf("Error: Memo key does not match the parameters at line %" PRId64 " in compile_verify\n", verify_line(vm, addr));
+        return ERR;
+    } else if ((type == TY_INST_RETURN || type == TY_INST_MEMO_RETURN) && istop) {
+        printf("Error: return outside a function at line %" PRId64 " in compile_verify\n", verify_line(vm, addr));
         return ERR;
     }
-    if (compile_tobin() == ERR) {
-        puts("Failed to tobin");
+    int64_t pop;
+    int64_t push;
+    verify_effect(code, addr, &pop, &push);
+    if (verify->depth[i] < pop) {
+        printf("Error: Stack underflow (%" PRId64 " of %" PRId64 " operands) at line %" PRId64 " in compile_verify\n", (int64_t)verify->depth[i], pop, verify_line(vm, addr));
         return ERR;
     }
-    if (compile_link() == ERR) {
-        puts("Failed to link");
+    int64_t depth = verify->depth[i] - pop + push;
+    if (type == TY_INST_JMP || type == TY_INST_JZ || type == TY_INST_JNZ) {
+        if (verify_reach(vm, verify, addr, code_label(code, addr + 1), depth, fn) == ERR) {
+            return ERR;
+        }
+    }
+    if (type == TY_INST_JMP || type == TY_INST_END || type == TY_INST_RETURN || type == TY_INST_MEMO_RETURN) {
+        return OK;
+    }
+    return verify_reach(vm, verify, addr, next, depth, fn);
+}
+
+// Proves what the unchecked dispatch loop relies on: every opcode is known, every jump, call and function target
+// starts an instruction of the same function, no path pops below its frame's operand stack or falls off the code, and
+// every frame offset lies in the frame. Each symbol gets its function's operand stack high-water mark, or -1 when
+// paths reach an instruction at different depths (a loop that leaves a value behind on each iteration).
+result_t compile_verify(vm_t* vm) {
+    uint8_t* code = (uint8_t*)vm->mem->compile.bin;
+    int64_t begin = CODE_ADDR(MEM_GLOBAL_SIZE);
+    int64_t size = vm->code_end - begin;
+    int64_t scratch_size = sizeof(verify_t) + size * (2 * sizeof(int32_t) + sizeof(uint8_t) + sizeof(int64_t));
+    verify_t* verify = mmap(NULL, scratch_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (verify == MAP_FAILED) {
+        puts("Error: Failed to allocate compile_verify");
         return ERR;
     }
-    return OK;
+    verify->work = (int64_t*)(verify + 1);
+    verify->depth = (int32_t*)(verify->work + size);
+    verify->owner = verify->depth + size;
+    verify->queued = (uint8_t*)(verify->owner + size);
+    result_t result = OK;
+    for (int64_t i = 0; i < size; i++) {
+        verify->depth[i] = VERIFY_NONE;
+    }
+    for (int64_t addr = begin; addr < vm->code_end; addr += 1 + code_operand_size(code_operand(code[addr]))) {
+        if (code[addr] < TY_INST_NOP || TY_INST_SNAPSHOT < code[addr] || code[addr] == TY_INST_CO_EXIT) {
+            printf("Error: Unknown opcode %d at %" PRId64 " in compile_verify\n", code[addr], addr);
+            result = ERR;
+            break;
+        }
+        verify->depth[addr - begin] = VERIFY_INST;
+    }
+    if (result == OK) {
+        result = verify_entry(vm, verify, begin, begin);
+    }
+    for (int64_t addr = begin; result == OK && addr < vm->code_end; addr += 1 + code_operand_size(code_operand(code[addr]))) {
+        if (code[addr] == TY_INST_CALL || code[addr] == TY_INST_PUSH_FN) {
+            result = verify_entry(vm, verify, addr, code_label(code, addr + 1));
+        }
+    }
+    for (int64_t i = 0; result == OK && i < vm->symbol_cnt; i++) {
+        result = verify_entry(vm, verify, vm->symbol[i].addr, vm->symbol[i].addr);
+    }
+    while (result == OK && verify->work_cnt > 0) {
+        int64_t addr = verify->work[--verify->work_cnt];
+        verify->queued[addr - begin] = FALSE;
+        result = verify_inst(vm, verify, addr);
+    }
+    for (int64_t i = 0; result == OK && i < vm->symbol_cnt; i++) {
+        int64_t fn = verify->owner[vm->symbol[i].addr - begin] - 1;
+        vm->symbol[i].stack_max = verify->fn_isbalanced[fn] ? verify->fn_max[fn] : -1;
+    }
+    munmap(verify, scratch_size);
+    return result;
 }
 
-result_t execute() {
-    while (TRUE) {
-        switch (mem.bin[mem.bin[GLOBALADDR_IP]++]) {
-            case TY_INST_NOP: {
-            } break;
+// Records the time since *start as the stage's duration when stats are on, and restarts the clock.
+void compile_stage(vm_t* vm, stage_t stage, int64_t* start) {
+    if (vm->stats == NULL) {
+        return;
+    }
+    int64_t now = vm_now();
+    vm->stats->stage_ns[stage] = now - *start;
+    *start = now;
+}
+
+// Counts what the compile used of each compile_t table while they are intact; the stack later overwrites them.
+void compile_stats(vm_t* vm) {
+    stats_t* stats = vm->stats;
+    if (stats == NULL) {
+        return;
+    }
+    compile_t* compile = &vm->mem->compile;
+    uint8_t* code = (uint8_t*)compile->bin;
+    int64_t code_itr = CODE_ADDR(MEM_GLOBAL_SIZE);
+    stats->src_size = __builtin_strlen(compile->src);
+    for (stats->token_cnt = 0; compile->token[stats->token_cnt].data != NULL; stats->token_cnt++) {
+    }
+    for (stats->node_cnt = 0; compile->node[stats->node_cnt].type != TY_NULL; stats->node_cnt++) {
+    }
+    while (code[code_itr] != TY_NULL) {
+        code_itr += 1 + code_operand_size(code_operand(code[code_itr]));
+    }
+    stats->code_size = code_itr - CODE_ADDR(MEM_GLOBAL_SIZE);
+    stats->symbol_cnt = vm->symbol_cnt;
+}
+
+// Stamps the recorded profile with the source hash and ignores a loaded profile that was recorded against other source.
+result_t compile_pgo(vm_t* vm) {
+    uint64_t hash = pgo_hash(vm->mem->compile.src);
+    if (vm->pgo != NULL) {
+        vm->pgo->hash = hash;
+    }
+    if (vm->pgo_use != NULL) {
+        vm->pgo_use->ismatch = vm->pgo_use->hash == hash;
+        if (!vm->pgo_use->ismatch) {
+            dprintf(STDERR_FILENO, "pgo: stale profile hash=%016" PRIx64 " src_hash=%016" PRIx64 "\n", vm->pgo_use->hash, hash);
+        }
+    }
+    return OK;
+}
+
+result_t compile_src(vm_t* vm) {
+    int64_t map_cnt = 0;
+    __builtin_memset(vm->memo, 0, sizeof(memo_t));
+    int64_t start = vm->stats == NULL ? 0 : vm_now();
+    if (compile_tokenize(vm) == ERR) {
+        puts("Failed to tokenize");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_TOKENIZE, &start);
+    if (compile_pgo(vm) == ERR) {
+        puts("Failed to check profile");
+        return ERR;
+    }
+    if (compile_parse(vm, &map_cnt) == ERR) {
+        puts("Failed to parse");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_PARSE, &start);
+    if (compile_layout(vm) == ERR) {
+        puts("Failed to lay out");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_LAYOUT, &start);
+    if (compile_analyze(vm, &map_cnt) == ERR) {
+        puts("Failed to analyze");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_ANALYZE, &start);
+    if (compile_purity(vm) == ERR) {
+        puts("Failed to check purity");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_PURITY, &start);
+    if (compile_tobin(vm) == ERR) {
+        puts("Failed to tobin");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_TOBIN, &start);
+    if (compile_link(vm) == ERR) {
+        puts("Failed to link");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_LINK, &start);
+    if (compile_symbol(vm) == ERR) {
+        puts("Failed to build symbol table");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_SYMBOL, &start);
+    if (compile_verify(vm) == ERR) {
+        puts("Failed to verify bytecode");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_VERIFY, &start);
+    compile_stats(vm);
+    return OK;
+}
+
+result_t compile(vm_t* vm, const char* path) {
+    int64_t start = vm->stats == NULL ? 0 : vm_now();
+    if (compile_readsrc(vm, path) == ERR) {
+        puts("Failed to readsrc");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_READ, &start);
+    return compile_src(vm);
+}
+
+result_t compile_str(vm_t* vm, const char* src, int64_t size) {
+    int64_t start = vm->stats == NULL ? 0 : vm_now();
+    if (compile_loadsrc(vm, src, size) == ERR) {
+        puts("Failed to loadsrc");
+        return ERR;
+    }
+    compile_stage(vm, STAGE_READ, &start);
+    return compile_src(vm);
+}
+
+// Block header at addr - 1: capacity in words, negated while the block is on a free list. The links and headers live
+// in script-writable memory, so a link outside the heap or a capacity past its top counts as exhausted memory.
+int64_t heap_alloc(vm_t* vm, int64_t n) {
+    int64_t* bin = vm->mem->bin;
+    int64_t begin = MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE;
+    int64_t end = MEM_SIZE / sizeof(int64_t);
+    int64_t size = n <= 1 ? 1 : n;
+    if (size <= (1 << (HEAP_CLASS_CNT - 1))) {
+        int64_t class_idx = size == 1 ? 0 : 64 - __builtin_clzll(size - 1);
+        int64_t* head = &bin[GLOBALADDR_HEAP_CLASS + class_idx];
+        size = 1 << class_idx;
+        if (*head != 0) {
+            int64_t addr = *head;
+            if (addr <= begin || bin[GLOBALADDR_HEAP_TOP] < addr + size) {
+                return 0;
+            }
+            *head = bin[addr];
+            bin[addr - 1] = size;
+            bin[GLOBALADDR_HEAP_IDLE] -= size + 1;
+            bin[GLOBALADDR_HEAP_LIVE] += size + 1;
+            bin[GLOBALADDR_HEAP_CNT]++;
+            return addr;
+        }
+    } else {
+        int64_t* link = &bin[GLOBALADDR_HEAP_LARGE];
+        size = (size + 7) & ~7;
+        while (*link != 0) {
+            int64_t addr = *link;
+            if (addr <= begin || bin[GLOBALADDR_HEAP_TOP] <= addr) {
+                return 0;
+            }
+            int64_t capacity = -bin[addr - 1];
+            if (capacity > bin[GLOBALADDR_HEAP_TOP] - addr) {
+                return 0;
+            }
+            if (capacity >= size) {
+                *link = bin[addr];
+                if (capacity - size >= HEAP_SPLIT_MIN) {
+                    int64_t rest = addr + size + 1;
+                    bin[rest - 1] = -(capacity - size - 1);
+                    bin[rest] = bin[GLOBALADDR_HEAP_LARGE];
+                    bin[GLOBALADDR_HEAP_LARGE] = rest;
+                    capacity = size;
+                }
+                bin[addr - 1] = capacity;
+                bin[GLOBALADDR_HEAP_IDLE] -= capacity + 1;
+                bin[GLOBALADDR_HEAP_LIVE] += capacity + 1;
+                bin[GLOBALADDR_HEAP_CNT]++;
+                return addr;
+            }
+            link = &bin[addr];
+        }
+    }
+    if (size + 1 > end - bin[GLOBALADDR_HEAP_TOP]) {
+        return 0;
+    }
+    int64_t addr = bin[GLOBALADDR_HEAP_TOP] + 1;
+    bin[GLOBALADDR_HEAP_TOP] += size + 1;
+    bin[addr - 1] = size;
+    bin[GLOBALADDR_HEAP_LIVE] += size + 1;
+    bin[GLOBALADDR_HEAP_CNT]++;
+    return addr;
+}
+
+result_t heap_free(vm_t* vm, int64_t addr) {
+    int64_t* bin = vm->mem->bin;
+    int64_t begin = MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE;
+    if (addr == 0) {
+        return OK;
+    }
+    if (addr <= begin || bin[GLOBALADDR_HEAP_TOP] <= addr || bin[addr - 1] <= 0) {
+        return ERR;
+    }
+    int64_t size = bin[addr - 1];
+    int64_t* head = &bin[GLOBALADDR_HEAP_LARGE];
+    if (size <= (1 << (HEAP_CLASS_CNT - 1))) {
+        head = &bin[GLOBALADDR_HEAP_CLASS + 63 - __builtin_clzll(size)];
+    }
+    bin[addr - 1] = -size;
+    bin[addr] = *head;
+    *head = addr;
+    bin[GLOBALADDR_HEAP_LIVE] -= size + 1;
+    bin[GLOBALADDR_HEAP_IDLE] += size + 1;
+    bin[GLOBALADDR_HEAP_CNT]--;
+    return OK;
+}
+
+int64_t heap_stat(vm_t* vm, int64_t fd) {
+    int64_t* bin = vm->mem->bin;
+    int64_t used = bin[GLOBALADDR_HEAP_TOP] - (int64_t)(MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE);
+    int64_t idle = bin[GLOBALADDR_HEAP_IDLE];
+    return dprintf(fd, "heap: live_bytes=%" PRId64 " live_blocks=%" PRId64 " free_bytes=%" PRId64 " used_bytes=%" PRId64 " capacity_bytes=%" PRId64 " fragmentation=%" PRId64 "%%\n",
+                   bin[GLOBALADDR_HEAP_LIVE] * (int64_t)sizeof(int64_t), bin[GLOBALADDR_HEAP_CNT], idle * (int64_t)sizeof(int64_t),
+                   used * (int64_t)sizeof(int64_t), (int64_t)MEM_HEAP_SIZE * (int64_t)sizeof(int64_t), used == 0 ? 0 : idle * 100 / used);
+}
+
+int64_t map_file(vm_t* vm, int64_t fd, int64_t* size) {
+    int64_t* bin = vm->mem->bin;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    int64_t addr = bin[GLOBALADDR_MAP_TOP];
+    int64_t len = (st.st_size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE * MEM_PAGE_SIZE;
+    if (len / (int64_t)sizeof(int64_t) > bin[GLOBALADDR_CO_BASE] - addr) {
+        return -1;
+    }
+    if (len != 0 && mmap(&bin[addr], len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        return -1;
+    }
+    bin[GLOBALADDR_MAP_TOP] += len / sizeof(int64_t);
+    *size = st.st_size;
+    return addr;
+}
+
+int64_t map_release(vm_t* vm, int64_t addr, int64_t size) {
+    int64_t* bin = vm->mem->bin;
+    int64_t begin = MEM_SIZE / sizeof(int64_t);
+    int64_t len = (size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE * MEM_PAGE_SIZE;
+    if (addr < begin || size < 0 || (addr - begin) % (MEM_PAGE_SIZE / sizeof(int64_t)) != 0 || len / (int64_t)sizeof(int64_t) > bin[GLOBALADDR_MAP_TOP] - addr) {
+        return -1;
+    }
+    if (len != 0 && mmap(&bin[addr], len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
+        return -1;
+    }
+    if (addr + len / (int64_t)sizeof(int64_t) == bin[GLOBALADDR_MAP_TOP]) {
+        bin[GLOBALADDR_MAP_TOP] = addr;
+    }
+    return 0;
+}
+
+uint64_t memo_hash(const int64_t* key, int64_t argc) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL;
+    for (int64_t i = 0; i <= argc; i++) {
+        hash = (hash ^ (uint64_t)key[i]) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+bool_t memo_iseq(memo_entry_t* entry, const int64_t* key, int64_t argc) {
+    for (int64_t i = 0; i <= argc; i++) {
+        if (entry->key[i] != key[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// key[0] identifies the function, key[1..argc] are its arguments; an entry with key[0] == 0 is empty.
+int64_t* memo_find(vm_t* vm, const int64_t* key, int64_t argc) {
+    uint64_t hash = memo_hash(key, argc);
+    for (int64_t i = 0; i < MEMO_PROBE_MAX; i++) {
+        memo_entry_t* entry = &vm->memo->entry[(hash + i) & (MEMO_SIZE - 1)];
+        if (entry->key[0] == 0) {
+            break;
+        }
+        if (memo_iseq(entry, key, argc)) {
+            vm->memo->hit++;
+            return &entry->val;
+        }
+    }
+    vm->memo->miss++;
+    return NULL;
+}
+
+void memo_insert(vm_t* vm, const int64_t* key, int64_t argc, int64_t val) {
+    uint64_t hash = memo_hash(key, argc);
+    memo_entry_t* entry = &vm->memo->entry[hash & (MEMO_SIZE - 1)];
+    for (int64_t i = 0; i < MEMO_PROBE_MAX; i++) {
+        memo_entry_t* probe = &vm->memo->entry[(hash + i) & (MEMO_SIZE - 1)];
+        if (probe->key[0] == 0 || memo_iseq(probe, key, argc)) {
+            entry = probe;
+            break;
+        }
+    }
+    if (entry->key[0] == 0) {
+        vm->memo->cnt++;
+    }
+    for (int64_t i = 0; i <= argc; i++) {
+        entry->key[i] = key[i];
+    }
+    entry->val = val;
+}
+
+int64_t memo_stat(vm_t* vm, int64_t fd) {
+    return dprintf(fd, "memo: hits=%" PRId64 " misses=%" PRId64 " entries=%" PRId64 " capacity=%" PRId64 "\n", vm->memo->hit, vm->memo->miss, vm->memo->cnt, (int64_t)MEMO_SIZE);
+}
+
+__attribute__((target_clones("avx2", "default"))) void vec_fill(int64_t* dst, int64_t val, int64_t n) {
+    vec_t v = (vec_t){val, val, val, val};
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        *(vec_t*)(dst + i + 0) = v;
+        *(vec_t*)(dst + i + 4) = v;
+    }
+    for (; i < n; i++) {
+        dst[i] = val;
+    }
+}
+
+__attribute__((target_clones("avx2", "default"))) int64_t vec_cmp(const int64_t* src1, const int64_t* src2, int64_t n) {
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vec_t diff = *(vec_t*)(src1 + i) ^ *(vec_t*)(src2 + i);
+        if ((diff[0] | diff[1] | diff[2] | diff[3]) != 0) {
+            break;
+        }
+    }
+    for (; i < n; i++) {
+        if (src1[i] != src2[i]) {
+            return src1[i] < src2[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+__attribute__((target_clones("avx2", "default"))) int64_t vec_find(const int64_t* src, int64_t val, int64_t n) {
+    vec_t v = (vec_t){val, val, val, val};
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vec_t hit = *(vec_t*)(src + i) == v;
+        if ((hit[0] | hit[1] | hit[2] | hit[3]) != 0) {
+            break;
+        }
+    }
+    for (; i < n; i++) {
+        if (src[i] == val) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target_clones("avx2", "default"))) void vec_map2(type_t type, int64_t* dst, const int64_t* src1, const int64_t* src2, int64_t n) {
+    int64_t i = 0;
+    switch (type) {
+        case TY_INST_VADD: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src1 + i) + *(vec_t*)(src2 + i);
+            }
+            for (; i < n; i++) {
+                dst[i] = src1[i] + src2[i];
+            }
+        } break;
+        case TY_INST_VSUB: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src1 + i) - *(vec_t*)(src2 + i);
+            }
+            for (; i < n; i++) {
+                dst[i] = src1[i] - src2[i];
+            }
+        } break;
+        case TY_INST_VMUL: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src1 + i) * *(vec_t*)(src2 + i);
+            }
+            for (; i < n; i++) {
+                dst[i] = src1[i] * src2[i];
+            }
+        } break;
+        case TY_INST_VSHL: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src1 + i) << *(vec_t*)(src2 + i);
+            }
+            for (; i < n; i++) {
+                dst[i] = src1[i] << src2[i];
+            }
+        } break;
+        case TY_INST_VSHR: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src1 + i) >> *(vec_t*)(src2 + i);
+            }
+            for (; i < n; i++) {
+                dst[i] = src1[i] >> src2[i];
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+__attribute__((target_clones("avx2", "default"))) void vec_map1(type_t type, int64_t* dst, const int64_t* src, int64_t val, int64_t n) {
+    vec_t v = (vec_t){val, val, val, val};
+    int64_t i = 0;
+    switch (type) {
+        case TY_INST_VADDS: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src + i) + v;
+            }
+            for (; i < n; i++) {
+                dst[i] = src[i] + val;
+            }
+        } break;
+        case TY_INST_VSUBS: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src + i) - v;
+            }
+            for (; i < n; i++) {
+                dst[i] = src[i] - val;
+            }
+        } break;
+        case TY_INST_VMULS: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src + i) * v;
+            }
+            for (; i < n; i++) {
+                dst[i] = src[i] * val;
+            }
+        } break;
+        case TY_INST_VSHLS: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src + i) << val;
+            }
+            for (; i < n; i++) {
+                dst[i] = src[i] << val;
+            }
+        } break;
+        case TY_INST_VSHRS: {
+            for (; i + 4 <= n; i += 4) {
+                *(vec_t*)(dst + i) = *(vec_t*)(src + i) >> val;
+            }
+            for (; i < n; i++) {
+                dst[i] = src[i] >> val;
+            }
+        } break;
+        default:
+            break;
+    }
+}
+
+// Fixed-point multiply: the product is kept in 128 bits, so operands whose product overflows int64 still shift back
+// into range. Only the low 7 bits of shift count. AVX2 has no 64x64->128 multiply, so this stays scalar.
+void vec_mulshr(int64_t* dst, const int64_t* src1, const int64_t* src2, int64_t shift, int64_t n) {
+    shift &= 127;
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = (int64_t)(((__int128)src1[i] * src2[i]) >> shift);
+    }
+}
+
+__attribute__((target_clones("avx2", "default"))) int64_t vec_reduce(type_t type, const int64_t* src, int64_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    vec_t acc = (vec_t){src[0], src[0], src[0], src[0]};
+    int64_t result = src[0];
+    int64_t i = 0;
+    switch (type) {
+        case TY_INST_VSUM: {
+            acc = (vec_t){0, 0, 0, 0};
+            for (; i + 4 <= n; i += 4) {
+                acc += *(vec_t*)(src + i);
+            }
+            result = acc[0] + acc[1] + acc[2] + acc[3];
+            for (; i < n; i++) {
+                result += src[i];
+            }
+        } break;
+        case TY_INST_VMIN: {
+            for (; i + 4 <= n; i += 4) {
+                vec_t val = *(vec_t*)(src + i);
+                vec_t mask = val < acc;
+                acc = (val & mask) | (acc & ~mask);
+            }
+            for (int64_t j = 0; j < 4; j++) {
+                result = acc[j] < result ? acc[j] : result;
+            }
+            for (; i < n; i++) {
+                result = src[i] < result ? src[i] : result;
+            }
+        } break;
+        case TY_INST_VMAX: {
+            for (; i + 4 <= n; i += 4) {
+                vec_t val = *(vec_t*)(src + i);
+                vec_t mask = val > acc;
+                acc = (val & mask) | (acc & ~mask);
+            }
+            for (int64_t j = 0; j < 4; j++) {
+                result = acc[j] > result ? acc[j] : result;
+            }
+            for (; i < n; i++) {
+                result = src[i] > result ? src[i] : result;
+            }
+        } break;
+        default:
+            break;
+    }
+    return result;
+}
+
+__attribute__((target_clones("avx2", "default"))) int64_t vec_dot(const int64_t* src1, const int64_t* src2, int64_t n) {
+    vec_t acc = (vec_t){0, 0, 0, 0};
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc += *(vec_t*)(src1 + i) * *(vec_t*)(src2 + i);
+    }
+    int64_t result = acc[0] + acc[1] + acc[2] + acc[3];
+    for (; i < n; i++) {
+        result += src1[i] * src2[i];
+    }
+    return result;
+}
+
+// Chase-Lev deque: the owning worker pushes and takes at the bottom, other workers steal from the top.
+void task_push(task_deque_t* deque, int64_t id) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->buf[bottom & (TASK_MAX - 1)], id, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+int64_t task_take(task_deque_t* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    int64_t id = __atomic_load_n(&deque->buf[bottom & (TASK_MAX - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            id = -1;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return id;
+}
+
+int64_t task_steal(task_deque_t* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return -1;
+    }
+    int64_t id = __atomic_load_n(&deque->buf[top & (TASK_MAX - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    return id;
+}
+
+// Calls fn(i) for every i of the task's range on a fresh stack at base; each call returns through the END at GLOBALADDR_END.
+// Fuel the task was granted but did not spend goes back to the shared budget.
+void task_run(vm_t* vm, int64_t id, int64_t base) {
+    int64_t* bin = vm->mem->bin;
+    task_t* task = &vm->pool->task[id];
+    vm_t task_vm = *vm;
+    int64_t val = 0;
+    task_vm.slice = 0;
+    vm_setfuel(&task_vm);
+    result_t result = OK;
+    for (int64_t i = task->begin; i < task->end && result == OK; i++) {
+        bin[base + 0] = i;
+        bin[base + 1] = CODE_ADDR(GLOBALADDR_END);
+        bin[base + 2] = base + 1;
+        bin[base + 3] = 0;
+        task_vm.ip = task->fn;
+        task_vm.bp = base + 4;
+        task_vm.sp = base + 1 + MEM_STACK_SIZE;
+        task_vm.sched = NULL;
+        if (task_vm.sp + MEM_STACK_SIZE > task_vm.stack_end) {
+            puts("Error: Stack overflow in task");
+            result = ERR;
+            break;
+        }
+        result = execute(&task_vm);
+        if (result == OK) {
+            val += bin[task_vm.sp - 1];
+        }
+        if (task_vm.sched != NULL) {
+            co_free(&task_vm);
+        }
+    }
+    if (task_vm.budget >= 0 && task_vm.fuel > 0) {
+        __atomic_add_fetch(&vm->pool->budget, task_vm.fuel, __ATOMIC_RELAXED);
+    }
+    task->val = val;
+    task->result = result;
+    __atomic_store_n(&task->isdone, TRUE, __ATOMIC_RELEASE);
+}
+
+bool_t task_help(vm_t* vm, int64_t base) {
+    task_pool_t* pool = vm->pool;
+    int64_t id = task_take(&pool->deque[vm->worker]);
+    for (int64_t i = 1; id == -1 && i < pool->worker_cnt; i++) {
+        id = task_steal(&pool->deque[(vm->worker + i) % pool->worker_cnt]);
+    }
+    if (id == -1) {
+        return FALSE;
+    }
+    __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    task_run(vm, id, base);
+    return TRUE;
+}
+
+void* task_worker(void* arg) {
+    vm_t* vm = arg;
+    task_pool_t* pool = vm->pool;
+    int64_t base = MEM_SIZE / sizeof(int64_t) - MEM_HEAP_SIZE - vm->worker * MEM_TASK_STACK_SIZE;
+    vm->stack_end = base + MEM_TASK_STACK_SIZE;
+    while (!__atomic_load_n(&pool->isstop, __ATOMIC_ACQUIRE)) {
+        if (task_help(vm, base)) {
+            continue;
+        }
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 && !__atomic_load_n(&pool->isstop, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+// The thread running the top-level code is worker 0; the others run on stacks carved out below the heap.
+result_t task_pool_init(vm_t* vm) {
+    task_pool_t* pool = mmap(NULL, sizeof(task_pool_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        puts("Error: Failed to allocate task pool");
+        return ERR;
+    }
+    pool->worker_cnt = vm->worker_cnt;
+    if (pool->worker_cnt < 1) {
+        pool->worker_cnt = 1;
+    } else if (pool->worker_cnt > TASK_WORKER_MAX) {
+        pool->worker_cnt = TASK_WORKER_MAX;
+    }
+    for (int64_t i = 0; i < TASK_MAX; i++) {
+        pool->task_free[i] = TASK_MAX - 1 - i;
+    }
+    pool->task_free_cnt = TASK_MAX;
+    pool->budget = vm->budget < 0 ? -1 : vm->budget - vm->grant;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    vm->pool = pool;
+    vm->worker = 0;
+    for (int64_t i = 1; i < pool->worker_cnt; i++) {
+        pool->worker[i] = *vm;
+        pool->worker[i].worker = i;
+        pthread_create(&pool->thread[i], NULL, task_worker, &pool->worker[i]);
+    }
+    return OK;
+}
+
+void task_pool_free(task_pool_t* pool) {
+    __atomic_store_n(&pool->isstop, TRUE, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int64_t i = 1; i < pool->worker_cnt; i++) {
+        pthread_join(pool->thread[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+    munmap(pool, sizeof(task_pool_t));
+}
+
+int64_t task_spawn(vm_t* vm, int64_t fn, int64_t begin, int64_t end) {
+    if (vm->pool == NULL && task_pool_init(vm) == ERR) {
+        return -1;
+    }
+    task_pool_t* pool = vm->pool;
+    vm_lock(vm);
+    int64_t id = pool->task_free_cnt == 0 ? -1 : pool->task_free[--pool->task_free_cnt];
+    vm_unlock(vm);
+    if (id == -1) {
+        return -1;
+    }
+    pool->task[id] = (task_t){.fn = fn, .begin = begin, .end = end, .val = 0, .result = OK, .isused = TRUE, .isdone = FALSE};
+    task_push(&pool->deque[vm->worker], id);
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return id;
+}
+
+// While the task is unfinished the joining thread runs other tasks on the stack above base.
+result_t task_join(vm_t* vm, int64_t id, int64_t base, int64_t* val) {
+    task_pool_t* pool = vm->pool;
+    if (pool == NULL || id < 0 || TASK_MAX <= id || !pool->task[id].isused) {
+        return ERR;
+    }
+    task_t* task = &pool->task[id];
+    while (!__atomic_load_n(&task->isdone, __ATOMIC_ACQUIRE)) {
+        if (!task_help(vm, base)) {
+            sched_yield();
+        }
+    }
+    vm_lock(vm);
+    if (!task->isused) {
+        vm_unlock(vm);
+        return ERR;
+    }
+    task->isused = FALSE;
+    pool->task_free[pool->task_free_cnt++] = id;
+    vm_unlock(vm);
+    *val = task->val;
+    return task->result;
+}
+
+result_t task_pfor(vm_t* vm, int64_t fn, int64_t begin, int64_t end, int64_t base, int64_t* val) {
+    if (vm->pool == NULL && task_pool_init(vm) == ERR) {
+        return ERR;
+    }
+    int64_t chunk_cnt = vm->pool->worker_cnt * TASK_CHUNK_PER_WORKER;
+    int64_t chunk = end <= begin ? 1 : (end - begin + chunk_cnt - 1) / chunk_cnt;
+    int64_t id[TASK_WORKER_MAX * TASK_CHUNK_PER_WORKER];
+    int64_t id_cnt = 0;
+    result_t result = OK;
+    for (int64_t i = begin; i < end; i += chunk) {
+        id[id_cnt] = task_spawn(vm, fn, i, end - i < chunk ? end : i + chunk);
+        if (id[id_cnt] == -1) {
+            result = ERR;
+            break;
+        }
+        id_cnt++;
+    }
+    *val = 0;
+    for (int64_t i = 0; i < id_cnt; i++) {
+        int64_t task_val = 0;
+        result_t join_result = task_join(vm, id[i], base, &task_val);
+        if (join_result != OK && result == OK) {
+            result = join_result;
+        }
+        *val += task_val;
+    }
+    return result;
+}
+
+bool_t co_isready(int64_t fd, int64_t events) {
+    struct pollfd pfd = (struct pollfd){.fd = fd, .events = events, .revents = 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// The top-level code is coroutine 0 and keeps using the main stack.
+result_t co_init(vm_t* vm) {
+    sched_t* sched = mmap(NULL, sizeof(sched_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) {
+        puts("Error: Failed to allocate scheduler");
+        return ERR;
+    }
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epfd == -1) {
+        puts("Error: Failed to create epoll instance");
+        munmap(sched, sizeof(sched_t));
+        return ERR;
+    }
+    sched->co[0].state = CO_RUN;
+    sched->cur = 0;
+    sched->alive = 1;
+    vm->sched = sched;
+    return OK;
+}
+
+// Coroutine stacks are MEM_CO_STACK_SIZE-word slots taken down from the top of the map window, where untouched pages
+// cost nothing, while _mmap fills it up from the bottom. Freed slots go on a list at GLOBALADDR_CO_FREE linked through
+// their first word; a link that is not a slot above GLOBALADDR_CO_BASE counts as exhausted address space. Call with
+// the pool lock held.
+int64_t co_stack_alloc(vm_t* vm) {
+    int64_t* bin = vm->mem->bin;
+    int64_t end = (MEM_SIZE + MEM_MAP_SIZE) / sizeof(int64_t);
+    int64_t base = bin[GLOBALADDR_CO_FREE];
+    if (base != 0) {
+        if (base < bin[GLOBALADDR_CO_BASE] || end - MEM_CO_STACK_SIZE < base) {
+            return 0;
+        }
+        bin[GLOBALADDR_CO_FREE] = bin[base];
+        return base;
+    }
+    base = bin[GLOBALADDR_CO_BASE] - MEM_CO_STACK_SIZE;
+    if (base < bin[GLOBALADDR_MAP_TOP]) {
+        return 0;
+    }
+    bin[GLOBALADDR_CO_BASE] = base;
+    return base;
+}
+
+void co_stack_free(vm_t* vm, int64_t base) {
+    int64_t* bin = vm->mem->bin;
+    bin[base] = bin[GLOBALADDR_CO_FREE];
+    bin[GLOBALADDR_CO_FREE] = base;
+}
+
+void co_free(vm_t* vm) {
+    for (int64_t i = 1; i < CO_MAX; i++) {
+        if (vm->sched->co[i].state != CO_FREE) {
+            vm_lock(vm);
+            co_stack_free(vm, vm->sched->co[i].stack);
+            vm_unlock(vm);
+        }
+    }
+    close(vm->sched->epfd);
+    munmap(vm->sched, sizeof(sched_t));
+    vm->sched = NULL;
+}
+
+void co_ready(sched_t* sched, int64_t id) {
+    sched->co[id].state = CO_READY;
+    sched->ready[(sched->ready_head + sched->ready_cnt) % CO_MAX] = id;
+    sched->ready_cnt++;
+}
+
+int64_t co_go(vm_t* vm, int64_t fn, int64_t arg) {
+    if (vm->sched == NULL && co_init(vm) == ERR) {
+        return -1;
+    }
+    sched_t* sched = vm->sched;
+    int64_t id = 1;
+    while (id < CO_MAX && sched->co[id].state != CO_FREE) {
+        id++;
+    }
+    if (id == CO_MAX) {
+        return -1;
+    }
+    vm_lock(vm);
+    int64_t base = co_stack_alloc(vm);
+    vm_unlock(vm);
+    if (base == 0) {
+        return -1;
+    }
+    int64_t* bin = vm->mem->bin;
+    bin[base + 0] = arg;
+    bin[base + 1] = CODE_ADDR(GLOBALADDR_CO_EXIT);
+    bin[base + 2] = base + 1;
+    bin[base + 3] = 0;
+    sched->co[id] = (co_t){.state = CO_READY, .stack = base, .stack_end = base + MEM_CO_STACK_SIZE, .ip = fn, .sp = base + 1 + MEM_STACK_SIZE, .bp = base + 4, .fd = -1, .events = 0, .wake = 0};
+    co_ready(sched, id);
+    sched->alive++;
+    return id;
+}
+
+result_t co_wait_fd(vm_t* vm, int64_t fd, int64_t events) {
+    sched_t* sched = vm->sched;
+    co_t* co = &sched->co[sched->cur];
+    co->state = CO_WAIT_FD;
+    co->fd = fd;
+    co->events = events;
+    struct epoll_event ev = (struct epoll_event){.events = 0, .data.fd = fd};
+    for (int64_t i = 0; i < CO_MAX; i++) {
+        if (sched->co[i].state == CO_WAIT_FD && sched->co[i].fd == fd) {
+            ev.events |= sched->co[i].events;
+        }
+    }
+    if (epoll_ctl(sched->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 && (errno != EEXIST || epoll_ctl(sched->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+        return ERR;
+    }
+    return OK;
+}
+
+// Wakes expired timers, then blocks in epoll (or sleeps until the next timer) until some coroutine is ready.
+result_t co_wait(vm_t* vm) {
+    sched_t* sched = vm->sched;
+    int64_t now = vm_now();
+    int64_t deadline = -1;
+    bool_t isfd = FALSE;
+    for (int64_t i = 0; i < CO_MAX; i++) {
+        co_t* co = &sched->co[i];
+        if (co->state == CO_WAIT_TIME && co->wake <= now) {
+            co_ready(sched, i);
+        } else if (co->state == CO_WAIT_TIME && (deadline == -1 || co->wake < deadline)) {
+            deadline = co->wake;
+        } else if (co->state == CO_WAIT_FD) {
+            isfd = TRUE;
+        }
+    }
+    if (sched->ready_cnt > 0) {
+        return OK;
+    }
+    if (!isfd && deadline == -1) {
+        return ERR;
+    }
+    if (!isfd) {
+        struct timespec ts = (struct timespec){.tv_sec = deadline / 1000000000LL, .tv_nsec = deadline % 1000000000LL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        return OK;
+    }
+    struct epoll_event ev[CO_MAX];
+    int n = epoll_wait(sched->epfd, ev, CO_MAX, deadline == -1 ? -1 : (deadline - now + 999999) / 1000000);
+    for (int i = 0; i < n; i++) {
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, ev[i].data.fd, NULL);
+        for (int64_t j = 0; j < CO_MAX; j++) {
+            if (sched->co[j].state == CO_WAIT_FD && sched->co[j].fd == ev[i].data.fd) {
+                co_ready(sched, j);
+            }
+        }
+    }
+    return OK;
+}
+
+// Saves the registers in vm into the running coroutine and loads the next ready one into vm.
+result_t co_switch(vm_t* vm) {
+    sched_t* sched = vm->sched;
+    co_t* co = &sched->co[sched->cur];
+    co->ip = vm->ip;
+    co->sp = vm->sp;
+    co->bp = vm->bp;
+    co->stack_end = vm->stack_end;
+    if (co->state == CO_RUN) {
+        co_ready(sched, sched->cur);
+    }
+    while (sched->ready_cnt == 0) {
+        if (co_wait(vm) == ERR) {
+            return ERR;
+        }
+    }
+    sched->cur = sched->ready[sched->ready_head];
+    sched->ready_head = (sched->ready_head + 1) % CO_MAX;
+    sched->ready_cnt--;
+    co = &sched->co[sched->cur];
+    co->state = CO_RUN;
+    vm->ip = co->ip;
+    vm->sp = co->sp;
+    vm->bp = co->bp;
+    vm->stack_end = co->stack_end;
+    return OK;
+}
+
+void co_exit(vm_t* vm) {
+    sched_t* sched = vm->sched;
+    vm_lock(vm);
+    co_stack_free(vm, sched->co[sched->cur].stack);
+    vm_unlock(vm);
+    sched->co[sched->cur].state = CO_FREE;
+    sched->alive--;
+    if (sched->alive == 1 && sched->co[0].state == CO_WAIT_ALL) {
+        co_ready(sched, 0);
+    }
+}
+
+debug_t* profile_debug(vm_t* vm, int64_t addr) {
+    int64_t lo = 0;
+    int64_t hi = vm->debug_cnt;
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if (vm->debug[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? NULL : &vm->debug[lo - 1];
+}
+
+void profile_insert(profile_t* profile, const int64_t* frame, int64_t depth) {
+    uint64_t hash = memo_hash(frame, depth - 1);
+    __atomic_fetch_add(&profile->sample, 1, __ATOMIC_RELAXED);
+    for (int64_t i = 0; i < PROFILE_PROBE_MAX; i++) {
+        profile_stack_t* stack = &profile->stack[(hash + i) % PROFILE_STACK_MAX];
+        int64_t state = __atomic_load_n(&stack->state, __ATOMIC_ACQUIRE);
+        if (state == 0) {
+            if (!__atomic_compare_exchange_n(&stack->state, &state, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            stack->depth = depth;
+            __builtin_memcpy(stack->frame, frame, depth * sizeof(int64_t));
+            stack->cnt = 1;
+            __atomic_store_n(&stack->state, 2, __ATOMIC_RELEASE);
+            return;
+        }
+        if (state == 2 && stack->depth == depth && __builtin_memcmp(stack->frame, frame, depth * sizeof(int64_t)) == 0) {
+            __atomic_fetch_add(&stack->cnt, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&profile->drop, 1, __ATOMIC_RELAXED);
+}
+
+// SIGPROF handler: the leaf is the published ip; every function frame adds the call site below its return address.
+// The walk stops at top-level code or at a return into the END/CO_EXIT stubs that root tasks, coroutines and vm_call.
+// Frames are stored as the start of their debug range, so samples on the same line share one stack entry.
+void profile_sample(int sig) {
+    vm_t* vm = __atomic_load_n(&profile_vm, __ATOMIC_RELAXED);
+    if (sig != SIGPROF || vm == NULL || vm->profile == NULL) {
+        return;
+    }
+    int64_t* bin = vm->mem->bin;
+    int64_t ip = __atomic_load_n(&profile_ip, __ATOMIC_RELAXED);
+    int64_t bp = __atomic_load_n(&profile_bp, __ATOMIC_RELAXED);
+    int64_t frame[PROFILE_DEPTH_MAX];
+    int64_t depth = 0;
+    frame[depth++] = ip;
+    while (depth < PROFILE_DEPTH_MAX && CODE_ADDR(MEM_GLOBAL_SIZE) < ip && ip < vm->fn_end && mem_isrange(bp - 3, 3)) {
+        ip = bin[bp - 3] - 1;
+        bp = bin[bp - 1];
+        if (ip < CODE_ADDR(MEM_GLOBAL_SIZE)) {
+            break;
+        }
+        frame[depth++] = ip;
+    }
+    for (int64_t i = 0; i < depth; i++) {
+        debug_t* debug = profile_debug(vm, frame[i]);
+        frame[i] = debug == NULL ? frame[i] : debug->addr;
+    }
+    profile_insert(vm->profile, frame, depth);
+}
+
+result_t profile_timer(int64_t interval) {
+    struct itimerval timer = (struct itimerval){.it_interval = {.tv_sec = 0, .tv_usec = interval}, .it_value = {.tv_sec = 0, .tv_usec = interval}};
+    return setitimer(ITIMER_PROF, &timer, NULL) == -1 ? ERR : OK;
+}
+
+// The timer is process-wide, so it runs while at least one context is being profiled.
+result_t profile_start() {
+    result_t result = OK;
+    pthread_mutex_lock(&profile_lock);
+    if (profile_user == 0) {
+        struct sigaction action = (struct sigaction){.sa_handler = profile_sample, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, NULL) == -1 || profile_timer(PROFILE_INTERVAL_US) == ERR) {
+            puts("Error: Failed to start the profiling timer");
+            result = ERR;
+        }
+    }
+    if (result == OK) {
+        profile_user++;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    return result;
+}
+
+void profile_stop() {
+    pthread_mutex_lock(&profile_lock);
+    if (--profile_user == 0) {
+        profile_timer(0);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+// Index of the function containing addr in vm->symbol, symbol_cnt for top-level code and -1 when unknown.
+int64_t profile_fn(vm_t* vm, int64_t addr) {
+    debug_t* debug = profile_debug(vm, addr);
+    if (debug == NULL) {
+        return -1;
+    }
+    if (debug->fn == -1) {
+        return vm->symbol_cnt;
+    }
+    for (int64_t i = 0; i < vm->symbol_cnt; i++) {
+        if (vm->symbol[i].addr == debug->fn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+token_t profile_fn_name(vm_t* vm, int64_t fn) {
+    if (fn == vm->symbol_cnt) {
+        return (token_t){.data = "(top)", .size = 5};
+    }
+    if (fn == -1) {
+        return (token_t){.data = "?", .size = 1};
+    }
+    return (token_t){.data = vm->symbol[fn].name, .size = vm->symbol[fn].name_size};
+}
+
+int64_t profile_line(vm_t* vm, int64_t addr) {
+    debug_t* debug = profile_debug(vm, addr);
+    return debug == NULL ? 0 : debug->line;
+}
+
+result_t vm_profile(vm_t* vm) {
+    if (vm->profile != NULL) {
+        return OK;
+    }
+    profile_t* profile = mmap(NULL, sizeof(profile_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (profile == MAP_FAILED) {
+        puts("Error: Failed to allocate profile");
+        return ERR;
+    }
+    if (profile_start() == ERR) {
+        munmap(profile, sizeof(profile_t));
+        return ERR;
+    }
+    vm->profile = profile;
+    return OK;
+}
+
+// One line per distinct stack, root first, as "fn:line;fn:line count" for flame graph tools.
+int64_t vm_profile_fold(vm_t* vm, int64_t fd) {
+    int64_t n = 0;
+    for (int64_t i = 0; vm->profile != NULL && i < PROFILE_STACK_MAX; i++) {
+        profile_stack_t* stack = &vm->profile->stack[i];
+        if (__atomic_load_n(&stack->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        for (int64_t j = stack->depth - 1; j >= 0; j--) {
+            token_t name = profile_fn_name(vm, profile_fn(vm, stack->frame[j]));
+            n += dprintf(fd, "%s%.*s:%" PRId64, j == stack->depth - 1 ? "" : ";", (int)name.size, name.data, profile_line(vm, stack->frame[j]));
+        }
+        n += dprintf(fd, " %" PRId64 "\n", stack->cnt);
+    }
+    return n;
+}
+
+int64_t profile_top(const int64_t* cnt, int64_t size) {
+    int64_t top = -1;
+    for (int64_t i = 0; i < size; i++) {
+        if (cnt[i] > 0 && (top == -1 || cnt[i] > cnt[top])) {
+            top = i;
+        }
+    }
+    return top;
+}
+
+// The top functions by self samples (the leaf frame) with their inclusive totals, then the top source lines.
+int64_t vm_profile_report(vm_t* vm, int64_t fd, int64_t top) {
+    profile_t* profile = vm->profile;
+    if (profile == NULL) {
+        return 0;
+    }
+    int64_t line_max = 0;
+    for (int64_t i = 0; i < vm->debug_cnt; i++) {
+        line_max = vm->debug[i].line > line_max ? vm->debug[i].line : line_max;
+    }
+    int64_t* line_self = mmap(NULL, (line_max + 1) * sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (line_self == MAP_FAILED) {
+        puts("Error: Failed to allocate profile report");
+        return 0;
+    }
+    int64_t fn_self[SYMBOL_MAX + 1] = {0};
+    int64_t fn_total[SYMBOL_MAX + 1] = {0};
+    int64_t fn_seen[SYMBOL_MAX + 1];
+    for (int64_t i = 0; i <= vm->symbol_cnt; i++) {
+        fn_seen[i] = -1;
+    }
+    for (int64_t i = 0; i < PROFILE_STACK_MAX; i++) {
+        profile_stack_t* stack = &profile->stack[i];
+        if (__atomic_load_n(&stack->state, __ATOMIC_ACQUIRE) != 2) {
+            continue;
+        }
+        int64_t leaf = profile_fn(vm, stack->frame[0]);
+        if (leaf != -1) {
+            fn_self[leaf] += stack->cnt;
+        }
+        line_self[profile_line(vm, stack->frame[0])] += stack->cnt;
+        for (int64_t j = 0; j < stack->depth; j++) {
+            int64_t fn = profile_fn(vm, stack->frame[j]);
+            if (fn != -1 && fn_seen[fn] != i) {
+                fn_seen[fn] = i;
+                fn_total[fn] += stack->cnt;
+            }
+        }
+    }
+    int64_t sample = profile->sample == 0 ? 1 : profile->sample;
+    int64_t n = dprintf(fd, "profile: samples=%" PRId64 " dropped=%" PRId64 " interval_us=%d\n", profile->sample, profile->drop, PROFILE_INTERVAL_US);
+    for (int64_t i = 0; i < top; i++) {
+        int64_t fn = profile_top(fn_self, vm->symbol_cnt + 1);
+        if (fn == -1) {
+            break;
+        }
+        token_t name = profile_fn_name(vm, fn);
+        n += dprintf(fd, "profile: fn=%.*s self=%" PRId64 " self_pct=%" PRId64 " total=%" PRId64 " total_pct=%" PRId64 "\n", (int)name.size, name.data,
+                     fn_self[fn], fn_self[fn] * 100 / sample, fn_total[fn], fn_total[fn] * 100 / sample);
+        fn_self[fn] = 0;
+    }
+    for (int64_t i = 0; i < top; i++) {
+        int64_t line = profile_top(line_self, line_max + 1);
+        if (line == -1) {
+            break;
+        }
+        n += dprintf(fd, "profile: line=%" PRId64 " self=%" PRId64 " self_pct=%" PRId64 "\n", line, line_self[line], line_self[line] * 100 / sample);
+        line_self[line] = 0;
+    }
+    munmap(line_self, (line_max + 1) * sizeof(int64_t));
+    return n;
+}
+
+result_t vm_pgo(vm_t* vm) {
+    if (vm->pgo != NULL) {
+        return OK;
+    }
+    pgo_t* pgo = mmap(NULL, sizeof(pgo_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pgo == MAP_FAILED) {
+        puts("Error: Failed to allocate pgo profile");
+        return ERR;
+    }
+    vm->pgo = pgo;
+    return OK;
+}
+
+// Sites are few and execute_loop only counts in its instrumented variant, so a binary search per branch is fine.
+__attribute__((always_inline)) static inline void pgo_count(pgo_t* pgo, int64_t addr, int64_t idx) {
+    int64_t lo = 0;
+    int64_t hi = pgo->site_cnt;
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        if (pgo->site[mid].addr < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < pgo->site_cnt && pgo->site[lo].addr == addr) {
+        __atomic_fetch_add(&pgo->site[lo].cnt[idx], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// One line per site keyed by the index of its token (if, loop or the callee's name) in the token list.
+int64_t vm_pgo_write(vm_t* vm, int64_t fd) {
+    pgo_t* pgo = vm->pgo;
+    if (pgo == NULL) {
+        return 0;
+    }
+    int64_t n = dprintf(fd, "pgo: hash=%016" PRIx64 " sites=%" PRId64 "\n", pgo->hash, pgo->site_cnt);
+    for (int64_t i = 0; i < pgo->site_cnt; i++) {
+        pgo_site_t* site = &pgo->site[i];
+        int64_t line = profile_line(vm, site->addr);
+        if (site->type == TY_INST_CALL) {
+            n += dprintf(fd, "pgo: site=call token=%" PRId64 " line=%" PRId64 " calls=%" PRId64 " fn=%.*s\n", site->token, line, site->cnt[0], (int)site->name_size, site->name);
+        } else if (site->type == TY_INST_JMP) {
+            n += dprintf(fd, "pgo: site=loop token=%" PRId64 " line=%" PRId64 " trips=%" PRId64 "\n", site->token, line, site->cnt[0]);
+        } else {
+            n += dprintf(fd, "pgo: site=branch token=%" PRId64 " line=%" PRId64 " true=%" PRId64 " false=%" PRId64 "\n", site->token, line, site->cnt[TRUE], site->cnt[FALSE]);
+        }
+    }
+    return n;
+}
+
+int pgo_site_cmp(const void* a, const void* b) {
+    int64_t token_a = ((const pgo_site_t*)a)->token;
+    int64_t token_b = ((const pgo_site_t*)b)->token;
+    return (token_a > token_b) - (token_a < token_b);
+}
+
+// Reads a profile written by vm_pgo_write for the next compile, which lays out its ifs by the branch counts.
+result_t vm_pgo_load(vm_t* vm, int64_t fd) {
+    pgo_t* pgo = vm->pgo_use;
+    if (pgo == NULL) {
+        pgo = mmap(NULL, sizeof(pgo_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pgo == MAP_FAILED) {
+            puts("Error: Failed to allocate pgo profile");
+            return ERR;
+        }
+        vm->pgo_use = pgo;
+    }
+    pgo->hash = 0;
+    pgo->ismatch = FALSE;
+    pgo->site_cnt = 0;
+    FILE* fp = fdopen(dup(fd), "r");
+    if (fp == NULL) {
+        puts("Error: Failed to read pgo profile");
+        return ERR;
+    }
+    char line[256];
+    bool_t ishash = FALSE;
+    while (fgets(line, sizeof(line), fp) != NULL && pgo->site_cnt < PGO_SITE_MAX) {
+        pgo_site_t site = (pgo_site_t){.token = 0, .addr = -1, .type = TY_NULL, .cnt = {0, 0}, .name_size = 0};
+        if (sscanf(line, "pgo: hash=%" SCNx64, &pgo->hash) == 1) {
+            ishash = TRUE;
+        } else if (sscanf(line, "pgo: site=branch token=%" SCNd64 " line=%*d true=%" SCNd64 " false=%" SCNd64, &site.token, &site.cnt[TRUE], &site.cnt[FALSE]) == 3) {
+            site.type = TY_INST_JZ;
+        } else if (sscanf(line, "pgo: site=call token=%" SCNd64 " line=%*d calls=%" SCNd64, &site.token, &site.cnt[0]) == 2) {
+            site.type = TY_INST_CALL;
+        } else if (sscanf(line, "pgo: site=loop token=%" SCNd64 " line=%*d trips=%" SCNd64, &site.token, &site.cnt[0]) == 2) {
+            site.type = TY_INST_JMP;
+        }
+        if (site.type != TY_NULL) {
+            pgo->site[pgo->site_cnt++] = site;
+        }
+    }
+    fclose(fp);
+    if (!ishash) {
+        puts("Error: Not a pgo profile");
+        return ERR;
+    }
+    qsort(pgo->site, pgo->site_cnt, sizeof(pgo_site_t), pgo_site_cmp);
+    return OK;
+}
+
+result_t vm_stats(vm_t* vm) {
+    if (vm->stats != NULL) {
+        return OK;
+    }
+    stats_t* stats = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        puts("Error: Failed to allocate stats");
+        return ERR;
+    }
+    vm->stats = stats;
+    return OK;
+}
+
+const char* stats_op_name(int64_t op) {
+    if (inst_name[op] != NULL) {
+        return inst_name[op];
+    }
+    for (builtin_t* itr = builtin; itr->name != NULL; itr++) {
+        if ((int64_t)itr->type == op) {
+            return itr->name;
+        }
+    }
+    return "unknown";
+}
+
+int64_t stats_cap(int64_t fd, bool_t isjson, const char* name, int64_t used, int64_t cap) {
+    if (isjson) {
+        return dprintf(fd, ",\"%s\":{\"used\":%" PRId64 ",\"cap\":%" PRId64 "}", name, used, cap);
+    }
+    return dprintf(fd, "stats: table=%s used=%" PRId64 " cap=%" PRId64 " used_pct=%" PRId64 "\n", name, used, cap, used * 100 / cap);
+}
+
+// Compile stage timings and table use against the compile_t capacities, then the run: frames, syscalls, pages
+// of vm->mem resident (mincore; the compile scratch counts, since compile touched it) and opcodes by count.
+int64_t vm_stats_report(vm_t* vm, int64_t fd, bool_t isjson) {
+    stats_t* stats = vm->stats;
+    if (stats == NULL) {
+        return 0;
+    }
+    compile_t* compile = &vm->mem->compile;
+    int64_t page_size = sizeof(mem_t) / MEM_PAGE_SIZE;
+    unsigned char* page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        puts("Error: Failed to allocate stats report");
+        return 0;
+    }
+    int64_t page_cnt = 0;
+    if (mincore(vm->mem, sizeof(mem_t), page) == 0) {
+        for (int64_t i = 0; i < page_size; i++) {
+            page_cnt += page[i] & 1;
+        }
+    }
+    munmap(page, page_size);
+    int64_t compile_ns = 0;
+    for (int64_t stage = 0; stage < STAGE_CNT; stage++) {
+        compile_ns += stats->stage_ns[stage];
+    }
+    int64_t n = 0;
+    if (isjson) {
+        n += dprintf(fd, "{\"compile_ns\":%" PRId64, compile_ns);
+        for (int64_t stage = 0; stage < STAGE_CNT; stage++) {
+            n += dprintf(fd, ",\"%s_ns\":%" PRId64, stage_name[stage], stats->stage_ns[stage]);
+        }
+    } else {
+        n += dprintf(fd, "stats: compile_ns=%" PRId64, compile_ns);
+        for (int64_t stage = 0; stage < STAGE_CNT; stage++) {
+            n += dprintf(fd, " %s_ns=%" PRId64, stage_name[stage], stats->stage_ns[stage]);
+        }
+        n += dprintf(fd, "\n");
+    }
+    n += stats_cap(fd, isjson, "src", stats->src_size, sizeof(compile->src));
+    n += stats_cap(fd, isjson, "token", stats->token_cnt, sizeof(compile->token) / sizeof(token_t));
+    n += stats_cap(fd, isjson, "node", stats->node_cnt, sizeof(compile->node) / sizeof(node_t));
+    n += stats_cap(fd, isjson, "symbol", stats->symbol_cnt, SYMBOL_MAX);
+    n += stats_cap(fd, isjson, "code", stats->code_size, sizeof(compile->bin) - CODE_ADDR(MEM_GLOBAL_SIZE));
+    const char* format = isjson ? ",\"dispatch\":%" PRId64 ",\"call\":%" PRId64 ",\"frame_peak\":%" PRId64 ",\"stack_peak_bytes\":%" PRId64
+                                  ",\"read\":%" PRId64 ",\"read_bytes\":%" PRId64 ",\"write\":%" PRId64 ",\"write_bytes\":%" PRId64 ",\"mem_touched_bytes\":%" PRId64
+                                : "stats: dispatch=%" PRId64 " call=%" PRId64 " frame_peak=%" PRId64 " stack_peak_bytes=%" PRId64 " read=%" PRId64 " read_bytes=%" PRId64
+                                  " write=%" PRId64 " write_bytes=%" PRId64 " mem_touched_bytes=%" PRId64 "\n";
+    n += dprintf(fd, format, stats->dispatch, stats->op[TY_INST_CALL] + stats->op[TY_INST_GO], stats->frame_peak, stats->frame_peak * MEM_STACK_SIZE * (int64_t)sizeof(int64_t),
+                 stats->read_cnt, stats->read_size, stats->write_cnt, stats->write_size, page_cnt * MEM_PAGE_SIZE);
+    int64_t op[STATS_OP_CNT];
+    __builtin_memcpy(op, stats->op, sizeof(op));
+    int64_t dispatch = stats->dispatch == 0 ? 1 : stats->dispatch;
+    n += isjson ? dprintf(fd, ",\"op\":{") : 0;
+    for (int64_t i = 0;; i++) {
+        int64_t top = profile_top(op, STATS_OP_CNT);
+        if (top == -1) {
+            break;
+        }
+        if (isjson) {
+            n += dprintf(fd, "%s\"%s\":%" PRId64, i == 0 ? "" : ",", stats_op_name(top), op[top]);
+        } else {
+            n += dprintf(fd, "stats: op=%s cnt=%" PRId64 " pct=%" PRId64 "\n", stats_op_name(top), op[top], op[top] * 100 / dispatch);
+        }
+        op[top] = 0;
+    }
+    n += isjson ? dprintf(fd, "}}\n") : 0;
+    return n;
+}
+
+// Adds one execute call's counts into the context's stats; task workers share them, so every add is atomic.
+void stats_merge(stats_t* stats, const stats_t* run) {
+    int64_t dispatch = 0;
+    for (int64_t i = 0; i < STATS_OP_CNT; i++) {
+        if (run->op[i] != 0) {
+            __atomic_fetch_add(&stats->op[i], run->op[i], __ATOMIC_RELAXED);
+            dispatch += run->op[i];
+        }
+    }
+    __atomic_fetch_add(&stats->dispatch, dispatch, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->read_cnt, run->read_cnt, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->read_size, run->read_size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->write_cnt, run->write_cnt, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->write_size, run->write_size, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&stats->frame_peak, __ATOMIC_RELAXED);
+    while (peak < run->frame_peak && !__atomic_compare_exchange_n(&stats->frame_peak, &peak, run->frame_peak, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Inlined five times: plain, with ip/bp published before every dispatch for the sampling profiler, counting
+// branches, calls and loop back-edges into vm->pgo, counting opcodes, frames and syscalls into vm->stats, and checked.
+// compile_verify has proved every opcode and target, so only the checked copy keeps the dispatch range check; it also
+// bounds the memory that DEREF, ASSIGN, _read and _write touch and the frames CALL lays out.
+__attribute__((always_inline)) static inline result_t execute_loop(vm_t* vm, bool_t isprofile, bool_t ispgo, bool_t isstats, bool_t ischecked) {
+    int64_t* bin = vm->mem->bin;
+    uint8_t* code = (uint8_t*)bin;
+    int64_t ip = vm->ip;
+    int64_t sp = vm->sp;
+    int64_t bp = vm->bp;
+    int64_t fuel = vm->fuel;
+    stats_t run;
+    int64_t frame = 0;
+    if (isstats) {
+        __builtin_memset(&run, 0, sizeof(run));
+    }
+    result_t result = OK;
+    while (result == OK) {
+        if (isstats) {
+            run.op[code[ip]]++;
+        }
+        if (isprofile) {
+            __atomic_store_n(&profile_ip, ip, __ATOMIC_RELAXED);
+            __atomic_store_n(&profile_bp, bp, __ATOMIC_RELAXED);
+        }
+        if (ischecked && !vm_iscode(vm, ip)) {
+            puts("Error: Invalid instruction address");
+            result = ERR;
+            break;
+        }
+        if (ischecked && !mem_ischecked(vm, sp, sizeof(int64_t), sizeof(int64_t), TRUE)) {
+            puts("Error: Stack out of range");
+            result = ERR;
+            break;
+        }
+        switch (code[ip++]) {
+            case TY_INST_NOP: {
+            } break;
             case TY_INST_END: {
+                if (vm->sched != NULL && vm->sched->alive > 1) {
+                    ip--;
+                    vm->sched->co[vm->sched->cur].state = CO_WAIT_ALL;
+                    vm->ip = ip;
+                    vm->sp = sp;
+                    vm->bp = bp;
+                    if (co_switch(vm) == ERR) {
+                        puts("Error: All coroutines are blocked");
+                        result = ERR;
+                        break;
+                    }
+                    ip = vm->ip;
+                    sp = vm->sp;
+                    bp = vm->bp;
+                    break;
+                }
+                vm->ip = ip - 1;
+                vm->sp = sp;
+                vm->bp = bp;
+                vm->fuel = fuel;
+                if (isstats) {
+                    stats_merge(vm->stats, &run);
+                }
                 return OK;
             } break;
+            case TY_INST_PUSH_LOCAL_VAL8: {
+                int64_t addr = (int8_t)code[ip++] + bp;
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), FALSE)) {
+                    puts("Error: Out of range in local");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = bin[addr];
+            } break;
             case TY_INST_PUSH_LOCAL_VAL: {
-                int64_t addr = mem.bin[mem.bin[GLOBALADDR_IP]++] + mem.bin[GLOBALADDR_BP];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = mem.bin[addr];
+                int64_t addr = code_i32(code, ip) + bp;
+                ip += sizeof(int32_t);
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), FALSE)) {
+                    puts("Error: Out of range in local");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = bin[addr];
+            } break;
+            case TY_INST_PUSH_LOCAL_ADDR8: {
+                int64_t addr = (int8_t)code[ip++] + bp;
+                bin[sp++] = addr;
             } break;
             case TY_INST_PUSH_LOCAL_ADDR: {
-                int64_t addr = mem.bin[mem.bin[GLOBALADDR_IP]++] + mem.bin[GLOBALADDR_BP];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = addr;
+                int64_t addr = code_i32(code, ip) + bp;
+                ip += sizeof(int32_t);
+                bin[sp++] = addr;
+            } break;
+            case TY_INST_PUSH_CONST8: {
+                int64_t val = (int8_t)code[ip++];
+                bin[sp++] = val;
+            } break;
+            case TY_INST_PUSH_CONST32: {
+                int64_t val = code_i32(code, ip);
+                ip += sizeof(int32_t);
+                bin[sp++] = val;
             } break;
             case TY_INST_PUSH_CONST: {
-                int64_t val = mem.bin[mem.bin[GLOBALADDR_IP]++];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val;
+                int64_t val = code_i64(code, ip);
+                ip += sizeof(int64_t);
+                bin[sp++] = val;
+            } break;
+            case TY_INST_PUSH_FN: {
+                int64_t addr = code_label(code, ip);
+                ip += CODE_LABEL_SIZE;
+                bin[sp++] = addr;
             } break;
             case TY_INST_DEREF: {
-                int64_t addr = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = mem.bin[addr];
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), FALSE)) {
+                    puts("Error: Out of range in deref");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = bin[addr];
+            } break;
+            case TY_INST_DEREF8: {
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(uint8_t), sizeof(uint8_t), FALSE)) {
+                    puts("Error: Out of range in deref8");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = ((uint8_t*)bin)[addr];
+            } break;
+            case TY_INST_DEREF32: {
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int32_t), sizeof(int32_t), FALSE)) {
+                    puts("Error: Out of range in deref32");
+                    result = ERR;
+                    break;
+                }
+                int32_t val;
+                __builtin_memcpy(&val, (int32_t*)bin + addr, sizeof(int32_t));
+                bin[sp++] = val;
             } break;
             case TY_INST_ASSIGN1:
-            case TY_INST_ASSIGN2:
-            case TY_INST_ASSIGN3:
             case TY_INST_ASSIGN4: {
-                int64_t val = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t addr = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[addr] = val;
+                int64_t val = bin[--sp];
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), TRUE)) {
+                    puts("Error: Out of range in assign");
+                    result = ERR;
+                    break;
+                }
+                bin[addr] = val;
+            } break;
+            case TY_INST_ASSIGN2: {
+                int64_t val = bin[--sp];
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(uint8_t), sizeof(uint8_t), TRUE)) {
+                    puts("Error: Out of range in assign8");
+                    result = ERR;
+                    break;
+                }
+                ((uint8_t*)bin)[addr] = val;
+            } break;
+            case TY_INST_ASSIGN3: {
+                int64_t val = bin[--sp];
+                int64_t addr = bin[--sp];
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int32_t), sizeof(int32_t), TRUE)) {
+                    puts("Error: Out of range in assign32");
+                    result = ERR;
+                    break;
+                }
+                int32_t val32 = val;
+                __builtin_memcpy((int32_t*)bin + addr, &val32, sizeof(int32_t));
             } break;
             case TY_INST_CALL: {
-                mem.bin[mem.bin[GLOBALADDR_SP] + 0] = mem.bin[GLOBALADDR_IP] + 1;
-                mem.bin[mem.bin[GLOBALADDR_SP] + 1] = mem.bin[GLOBALADDR_SP];
-                mem.bin[mem.bin[GLOBALADDR_SP] + 2] = mem.bin[GLOBALADDR_BP];
-                mem.bin[GLOBALADDR_IP] = mem.bin[mem.bin[GLOBALADDR_IP]];
-                mem.bin[GLOBALADDR_BP] = mem.bin[GLOBALADDR_SP] + 3;
-                mem.bin[GLOBALADDR_SP] += MEM_STACK_SIZE;
+                if (ispgo) {
+                    pgo_count(vm->pgo, ip - 1, 0);
+                }
+                if (sp + MEM_STACK_SIZE > vm->stack_end || (ischecked && !mem_ischecked(vm, sp, sizeof(int64_t), MEM_STACK_SIZE * sizeof(int64_t), TRUE))) {
+                    puts("Error: Stack overflow in call");
+                    result = ERR;
+                    break;
+                }
+                bin[sp + 0] = ip + CODE_LABEL_SIZE;
+                bin[sp + 1] = sp;
+                bin[sp + 2] = bp;
+                ip = code_label(code, ip);
+                bp = sp + 3;
+                sp += MEM_STACK_SIZE;
+                if (isstats && ++frame > run.frame_peak) {
+                    run.frame_peak = frame;
+                }
+                if (--fuel < 0) {
+                    vm->ip = ip;
+                    vm->sp = sp;
+                    vm->bp = bp;
+                    vm->fuel = fuel;
+                    result = vm_refuel(vm);
+                    fuel = vm->fuel;
+                }
             } break;
             case TY_INST_RETURN: {
-                int64_t ret_val = mem.bin[mem.bin[GLOBALADDR_SP] - 1];
-                mem.bin[GLOBALADDR_IP] = mem.bin[mem.bin[GLOBALADDR_BP] - 3];
-                mem.bin[GLOBALADDR_SP] = mem.bin[mem.bin[GLOBALADDR_BP] - 2];
-                mem.bin[GLOBALADDR_BP] = mem.bin[mem.bin[GLOBALADDR_BP] - 1];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = ret_val;
+                if (isstats) {
+                    frame--;
+                }
+                int64_t ret_val = bin[sp - 1];
+                ip = bin[bp - 3];
+                sp = bin[bp - 2];
+                bp = bin[bp - 1];
+                if (ischecked && !vm_isframe(vm, ip, sp, bp)) {
+                    puts("Error: Invalid frame in return");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = ret_val;
+            } break;
+            case TY_INST_MEMO_ENTER: {
+                int64_t fn = ip - 1;
+                int64_t argc = code[ip++];
+                if (ischecked && (!mem_ischecked(vm, bp, sizeof(int64_t), (argc + 1) * sizeof(int64_t), TRUE) || !mem_ischecked(vm, bp - 3 - argc, sizeof(int64_t), (argc + 3) * sizeof(int64_t), FALSE))) {
+                    puts("Error: Out of range in memo");
+                    result = ERR;
+                    break;
+                }
+                int64_t* key = &bin[bp];
+                key[0] = fn;
+                for (int64_t i = 0; i < argc; i++) {
+                    key[i + 1] = bin[bp - 4 - i];
+                }
+                vm_lock(vm);
+                int64_t* val = memo_find(vm, key, argc);
+                int64_t ret_val = val != NULL ? *val : 0;
+                vm_unlock(vm);
+                if (val != NULL) {
+                    if (isstats) {
+                        frame--;
+                    }
+                    ip = bin[bp - 3];
+                    sp = bin[bp - 2];
+                    bp = bin[bp - 1];
+                    if (ischecked && !vm_isframe(vm, ip, sp, bp)) {
+                        puts("Error: Invalid frame in return");
+                        result = ERR;
+                        break;
+                    }
+                    bin[sp++] = ret_val;
+                }
+            } break;
+            case TY_INST_MEMO_RETURN: {
+                int64_t argc = code[ip++];
+                int64_t ret_val = bin[sp - 1];
+                if (ischecked && !mem_ischecked(vm, bp - 3, sizeof(int64_t), (argc + 4) * sizeof(int64_t), FALSE)) {
+                    puts("Error: Out of range in memo");
+                    result = ERR;
+                    break;
+                }
+                vm_lock(vm);
+                memo_insert(vm, &bin[bp], argc, ret_val);
+                vm_unlock(vm);
+                if (isstats) {
+                    frame--;
+                }
+                ip = bin[bp - 3];
+                sp = bin[bp - 2];
+                bp = bin[bp - 1];
+                if (ischecked && !vm_isframe(vm, ip, sp, bp)) {
+                    puts("Error: Invalid frame in return");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = ret_val;
             } break;
             case TY_INST_JMP: {
-                int64_t addr = mem.bin[mem.bin[GLOBALADDR_IP]++];
-                mem.bin[GLOBALADDR_IP] = addr;
+                if (ispgo) {
+                    pgo_count(vm->pgo, ip - 1, 0);
+                }
+                int64_t addr = code_label(code, ip);
+                ip += CODE_LABEL_SIZE;
+                if (addr < ip && (fuel -= ip - addr) < 0) {
+                    vm->ip = addr;
+                    vm->sp = sp;
+                    vm->bp = bp;
+                    vm->fuel = fuel;
+                    result = vm_refuel(vm);
+                    fuel = vm->fuel;
+                }
+                ip = addr;
             } break;
             case TY_INST_JZ: {
-                int64_t addr = mem.bin[mem.bin[GLOBALADDR_IP]++];
-                int64_t val = mem.bin[--mem.bin[GLOBALADDR_SP]];
+                int64_t addr = code_label(code, ip);
+                int64_t val = bin[--sp];
+                if (ispgo) {
+                    pgo_count(vm->pgo, ip - 1, val != 0);
+                }
+                ip += CODE_LABEL_SIZE;
                 if (val == 0) {
-                    mem.bin[GLOBALADDR_IP] = addr;
+                    ip = addr;
+                }
+            } break;
+            case TY_INST_JNZ: {
+                int64_t addr = code_label(code, ip);
+                int64_t val = bin[--sp];
+                if (ispgo) {
+                    pgo_count(vm->pgo, ip - 1, val != 0);
+                }
+                ip += CODE_LABEL_SIZE;
+                if (val != 0) {
+                    ip = addr;
                 }
             } break;
             case TY_INST_OR: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 | val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 | val2;
             } break;
             case TY_INST_AND: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 & val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 & val2;
             } break;
             case TY_INST_EQ: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 == val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 == val2;
             } break;
             case TY_INST_NE: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 != val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 != val2;
             } break;
             case TY_INST_LT: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 < val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 < val2;
             } break;
             case TY_INST_LE: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 <= val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 <= val2;
             } break;
             case TY_INST_GT: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 > val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 > val2;
             } break;
             case TY_INST_GE: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 >= val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 >= val2;
             } break;
             case TY_INST_ADD: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 + val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 + val2;
             } break;
             case TY_INST_SUB: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 - val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 - val2;
             } break;
             case TY_INST_MUL: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 * val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 * val2;
             } break;
             case TY_INST_DIV: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
                 if (val2 == 0) {
-                    mem.bin[mem.bin[GLOBALADDR_SP]++] = INT64_MAX;
+                    bin[sp++] = INT64_MAX;
                 } else {
-                    mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 / val2;
+                    bin[sp++] = val1 / val2;
                 }
             } break;
             case TY_INST_MOD: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
                 if (val2 == 0) {
-                    mem.bin[mem.bin[GLOBALADDR_SP]++] = INT64_MAX;
+                    bin[sp++] = INT64_MAX;
                 } else {
-                    mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 % val2;
+                    bin[sp++] = val1 % val2;
                 }
             } break;
             case TY_INST_SHL: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 << val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 << val2;
             } break;
             case TY_INST_SHR: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 >> val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 >> val2;
             } break;
             case TY_INST_BITAND: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 & val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 & val2;
             } break;
             case TY_INST_BITOR: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 | val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 | val2;
             } break;
             case TY_INST_BITXOR: {
-                int64_t val2 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t val1 = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = val1 ^ val2;
+                int64_t val2 = bin[--sp];
+                int64_t val1 = bin[--sp];
+                bin[sp++] = val1 ^ val2;
             } break;
             case TY_INST_BITNOT: {
-                int64_t val = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = ~val;
+                int64_t val = bin[--sp];
+                bin[sp++] = ~val;
+            } break;
+            case TY_INST_NOT: {
+                int64_t val = bin[--sp];
+                bin[sp++] = !val;
+            } break;
+            case TY_INST_NEG: {
+                int64_t val = bin[--sp];
+                bin[sp++] = -val;
             } break;
             case TY_INST_READ: {
-                int64_t n = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t addr = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t fd = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = read(fd, &mem.bin[addr], n);
+                int64_t n = bin[--sp];
+                int64_t addr = bin[--sp];
+                int64_t fd = bin[--sp];
+                if (vm->sched != NULL && !co_isready(vm_fd(vm, fd), POLLIN)) {
+                    sp += 3;
+                    ip--;
+                    if (co_wait_fd(vm, vm_fd(vm, fd), EPOLLIN) == ERR) {
+                        puts("Error: Failed to wait for fd in _read");
+                        result = ERR;
+                        break;
+                    }
+                    vm->ip = ip;
+                    vm->sp = sp;
+                    vm->bp = bp;
+                    if (co_switch(vm) == ERR) {
+                        puts("Error: All coroutines are blocked");
+                        result = ERR;
+                        break;
+                    }
+                    ip = vm->ip;
+                    sp = vm->sp;
+                    bp = vm->bp;
+                    break;
+                }
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), n, TRUE)) {
+                    puts("Error: Out of range in _read");
+                    result = ERR;
+                    break;
+                }
+                int64_t ret = read(vm_fd(vm, fd), &bin[addr], n);
+                if (isstats) {
+                    run.read_cnt++;
+                    run.read_size += ret > 0 ? ret : 0;
+                }
+                bin[sp++] = ret;
             } break;
             case TY_INST_WRITE: {
-                int64_t n = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t addr = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                int64_t fd = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = write(fd, &mem.bin[addr], n);
+                int64_t n = bin[--sp];
+                int64_t addr = bin[--sp];
+                int64_t fd = bin[--sp];
+                if (vm->sched != NULL && !co_isready(vm_fd(vm, fd), POLLOUT)) {
+                    sp += 3;
+                    ip--;
+                    if (co_wait_fd(vm, vm_fd(vm, fd), EPOLLOUT) == ERR) {
+                        puts("Error: Failed to wait for fd in _write");
+                        result = ERR;
+                        break;
+                    }
+                    vm->ip = ip;
+                    vm->sp = sp;
+                    vm->bp = bp;
+                    if (co_switch(vm) == ERR) {
+                        puts("Error: All coroutines are blocked");
+                        result = ERR;
+                        break;
+                    }
+                    ip = vm->ip;
+                    sp = vm->sp;
+                    bp = vm->bp;
+                    break;
+                }
+                if (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), n, FALSE)) {
+                    puts("Error: Out of range in _write");
+                    result = ERR;
+                    break;
+                }
+                int64_t ret = write(vm_fd(vm, fd), &bin[addr], n);
+                if (isstats) {
+                    run.write_cnt++;
+                    run.write_size += ret > 0 ? ret : 0;
+                }
+                bin[sp++] = ret;
             } break;
             case TY_INST_USLEEP: {
-                int64_t val = mem.bin[--mem.bin[GLOBALADDR_SP]];
-                mem.bin[mem.bin[GLOBALADDR_SP]++] = usleep(val);
+                int64_t val = bin[--sp];
+                if (vm->sched == NULL) {
+                    bin[sp++] = usleep(val);
+                    break;
+                }
+                bin[sp++] = 0;
+                vm->sched->co[vm->sched->cur].state = CO_WAIT_TIME;
+                vm->sched->co[vm->sched->cur].wake = vm_now() + val * 1000;
+                vm->ip = ip;
+                vm->sp = sp;
+                vm->bp = bp;
+                if (co_switch(vm) == ERR) {
+                    puts("Error: All coroutines are blocked");
+                    result = ERR;
+                    break;
+                }
+                ip = vm->ip;
+                sp = vm->sp;
+                bp = vm->bp;
+            } break;
+            case TY_INST_MEMCPY: {
+                int64_t n = bin[--sp];
+                int64_t src = bin[--sp];
+                int64_t dst = bin[--sp];
+                if (!mem_isrange(dst, n) || !mem_isrange(src, n) || (ischecked && !mem_ischecked(vm, dst, sizeof(int64_t), n * sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _memcpy");
+                    result = ERR;
+                    break;
+                }
+                __builtin_memmove(&bin[dst], &bin[src], n * sizeof(int64_t));
+                bin[sp++] = dst;
+            } break;
+            case TY_INST_MEMSET: {
+                int64_t n = bin[--sp];
+                int64_t val = bin[--sp];
+                int64_t dst = bin[--sp];
+                if (!mem_isrange(dst, n) || (ischecked && !mem_ischecked(vm, dst, sizeof(int64_t), n * sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _memset");
+                    result = ERR;
+                    break;
+                }
+                vec_fill(&bin[dst], val, n);
+                bin[sp++] = dst;
+            } break;
+            case TY_INST_MEMCMP: {
+                int64_t n = bin[--sp];
+                int64_t src2 = bin[--sp];
+                int64_t src1 = bin[--sp];
+                if (!mem_isrange(src1, n) || !mem_isrange(src2, n)) {
+                    puts("Error: Out of range in _memcmp");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = vec_cmp(&bin[src1], &bin[src2], n);
+            } break;
+            case TY_INST_MEMCHR: {
+                int64_t n = bin[--sp];
+                int64_t val = bin[--sp];
+                int64_t src = bin[--sp];
+                if (!mem_isrange(src, n)) {
+                    puts("Error: Out of range in _memchr");
+                    result = ERR;
+                    break;
+                }
+                int64_t i = vec_find(&bin[src], val, n);
+                bin[sp++] = i == -1 ? -1 : src + i;
+            } break;
+            case TY_INST_VADD:
+            case TY_INST_VSUB:
+            case TY_INST_VMUL:
+            case TY_INST_VSHL:
+            case TY_INST_VSHR: {
+                type_t type = code[ip - 1];
+                int64_t n = bin[--sp];
+                int64_t src2 = bin[--sp];
+                int64_t src1 = bin[--sp];
+                int64_t dst = bin[--sp];
+                if (!mem_isrange(dst, n) || !mem_isrange(src1, n) || !mem_isrange(src2, n) || (ischecked && !mem_ischecked(vm, dst, sizeof(int64_t), n * sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in vector builtin");
+                    result = ERR;
+                    break;
+                }
+                vec_map2(type, &bin[dst], &bin[src1], &bin[src2], n);
+                bin[sp++] = dst;
+            } break;
+            case TY_INST_VADDS:
+            case TY_INST_VSUBS:
+            case TY_INST_VMULS:
+            case TY_INST_VSHLS:
+            case TY_INST_VSHRS: {
+                type_t type = code[ip - 1];
+                int64_t n = bin[--sp];
+                int64_t val = bin[--sp];
+                int64_t src = bin[--sp];
+                int64_t dst = bin[--sp];
+                if (!mem_isrange(dst, n) || !mem_isrange(src, n) || (ischecked && !mem_ischecked(vm, dst, sizeof(int64_t), n * sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in vector builtin");
+                    result = ERR;
+                    break;
+                }
+                vec_map1(type, &bin[dst], &bin[src], val, n);
+                bin[sp++] = dst;
+            } break;
+            case TY_INST_VMULSHR: {
+                int64_t n = bin[--sp];
+                int64_t shift = bin[--sp];
+                int64_t src2 = bin[--sp];
+                int64_t src1 = bin[--sp];
+                int64_t dst = bin[--sp];
+                if (!mem_isrange(dst, n) || !mem_isrange(src1, n) || !mem_isrange(src2, n) || (ischecked && !mem_ischecked(vm, dst, sizeof(int64_t), n * sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _vmulshr");
+                    result = ERR;
+                    break;
+                }
+                vec_mulshr(&bin[dst], &bin[src1], &bin[src2], shift, n);
+                bin[sp++] = dst;
+            } break;
+            case TY_INST_VSUM:
+            case TY_INST_VMIN:
+            case TY_INST_VMAX: {
+                type_t type = code[ip - 1];
+                int64_t n = bin[--sp];
+                int64_t src = bin[--sp];
+                if (!mem_isrange(src, n)) {
+                    puts("Error: Out of range in vector builtin");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = vec_reduce(type, &bin[src], n);
+            } break;
+            case TY_INST_VDOT: {
+                int64_t n = bin[--sp];
+                int64_t src2 = bin[--sp];
+                int64_t src1 = bin[--sp];
+                if (!mem_isrange(src1, n) || !mem_isrange(src2, n)) {
+                    puts("Error: Out of range in _vdot");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = vec_dot(&bin[src1], &bin[src2], n);
+            } break;
+            case TY_INST_ALLOC: {
+                int64_t n = bin[--sp];
+                vm_lock(vm);
+                bin[sp++] = heap_alloc(vm, n);
+                vm_unlock(vm);
+            } break;
+            case TY_INST_FREE: {
+                int64_t addr = bin[--sp];
+                vm_lock(vm);
+                result_t free_result = heap_free(vm, addr);
+                vm_unlock(vm);
+                if (free_result == ERR) {
+                    puts("Error: Invalid address in _free");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = 0;
+            } break;
+            case TY_INST_HEAPSTAT: {
+                int64_t fd = bin[--sp];
+                bin[sp++] = heap_stat(vm, vm_fd(vm, fd));
+            } break;
+            case TY_INST_MMAP: {
+                int64_t size_addr = bin[--sp];
+                int64_t fd = bin[--sp];
+                if (!mem_isrange(size_addr, 1) || (ischecked && !mem_ischecked(vm, size_addr, sizeof(int64_t), sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _mmap");
+                    result = ERR;
+                    break;
+                }
+                int64_t size = 0;
+                vm_lock(vm);
+                int64_t addr = map_file(vm, vm_fd(vm, fd), &size);
+                vm_unlock(vm);
+                bin[size_addr] = size;
+                bin[sp++] = addr;
+            } break;
+            case TY_INST_MUNMAP: {
+                int64_t size = bin[--sp];
+                int64_t addr = bin[--sp];
+                vm_lock(vm);
+                bin[sp++] = map_release(vm, addr, size);
+                vm_unlock(vm);
+            } break;
+            case TY_INST_MEMOSTAT: {
+                int64_t fd = bin[--sp];
+                bin[sp++] = memo_stat(vm, vm_fd(vm, fd));
+            } break;
+            case TY_INST_SPAWN: {
+                int64_t arg = bin[--sp];
+                int64_t fn = bin[--sp];
+                int64_t id = task_spawn(vm, fn, arg, arg + 1);
+                if (id == -1) {
+                    puts("Error: Too many tasks in _spawn");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = id;
+            } break;
+            case TY_INST_JOIN: {
+                int64_t id = bin[--sp];
+                int64_t val = 0;
+                result_t join_result = task_join(vm, id, sp, &val);
+                if (join_result != OK) {
+                    if (join_result == ERR) {
+                        puts("Error: Failed to join task in _join");
+                    }
+                    result = join_result;
+                    break;
+                }
+                bin[sp++] = val;
+            } break;
+            case TY_INST_PFOR: {
+                int64_t end = bin[--sp];
+                int64_t begin = bin[--sp];
+                int64_t fn = bin[--sp];
+                int64_t val = 0;
+                result_t pfor_result = task_pfor(vm, fn, begin, end, sp, &val);
+                if (pfor_result != OK) {
+                    if (pfor_result == ERR) {
+                        puts("Error: Failed to run tasks in _pfor");
+                    }
+                    result = pfor_result;
+                    break;
+                }
+                bin[sp++] = val;
+            } break;
+            case TY_INST_GO: {
+                int64_t arg = bin[--sp];
+                int64_t fn = bin[--sp];
+                int64_t id = co_go(vm, fn, arg);
+                if (id == -1) {
+                    puts("Error: Failed to start coroutine in _go");
+                    result = ERR;
+                    break;
+                }
+                if (isstats && ++frame > run.frame_peak) {
+                    run.frame_peak = frame;
+                }
+                bin[sp++] = id;
+            } break;
+            case TY_INST_YIELD: {
+                bin[sp++] = 0;
+                if (vm->sched == NULL) {
+                    break;
+                }
+                vm->ip = ip;
+                vm->sp = sp;
+                vm->bp = bp;
+                if (co_switch(vm) == ERR) {
+                    puts("Error: All coroutines are blocked");
+                    result = ERR;
+                    break;
+                }
+                ip = vm->ip;
+                sp = vm->sp;
+                bp = vm->bp;
+            } break;
+            case TY_INST_SNAPSHOT: {
+                bin[sp++] = 0;
+                if (!vm->issnapshot) {
+                    break;
+                }
+                if ((vm->sched != NULL && vm->sched->alive > 1) || (vm->pool != NULL && vm->pool->task_free_cnt != TASK_MAX)) {
+                    puts("Error: _snapshot while tasks or coroutines are running");
+                    result = ERR;
+                    break;
+                }
+                if (vm->sched != NULL) {
+                    co_free(vm);
+                }
+                if (vm->pool != NULL) {
+                    task_pool_free(vm->pool);
+                    vm->pool = NULL;
+                }
+                result = SNAPSHOT;
+            } break;
+            case TY_INST_CO_EXIT: {
+                if (isstats) {
+                    frame--;
+                }
+                co_exit(vm);
+                vm->ip = ip;
+                vm->sp = sp;
+                vm->bp = bp;
+                if (co_switch(vm) == ERR) {
+                    puts("Error: All coroutines are blocked");
+                    result = ERR;
+                    break;
+                }
+                ip = vm->ip;
+                sp = vm->sp;
+                bp = vm->bp;
+            } break;
+            case TY_INST_FETCHADD: {
+                int64_t val = bin[--sp];
+                int64_t addr = bin[--sp];
+                if (!mem_isrange(addr, 1) || (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _fetchadd");
+                    result = ERR;
+                    break;
+                }
+                bin[sp++] = __atomic_fetch_add(&bin[addr], val, __ATOMIC_SEQ_CST);
+            } break;
+            case TY_INST_CAS: {
+                int64_t desired = bin[--sp];
+                int64_t expected = bin[--sp];
+                int64_t addr = bin[--sp];
+                if (!mem_isrange(addr, 1) || (ischecked && !mem_ischecked(vm, addr, sizeof(int64_t), sizeof(int64_t), TRUE))) {
+                    puts("Error: Out of range in _cas");
+                    result = ERR;
+                    break;
+                }
+                __atomic_compare_exchange_n(&bin[addr], &expected, desired, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                bin[sp++] = expected;
+            } break;
+            default: {
+                if (!ischecked) {
+                    __builtin_unreachable();
+                }
+                puts("Error: Invalid instruction");
+                result = ERR;
             } break;
-            default:
-                return ERR;
         }
     }
+    vm->ip = ip;
+    vm->sp = sp;
+    vm->bp = bp;
+    vm->fuel = fuel;
+    if (isstats) {
+        stats_merge(vm->stats, &run);
+    }
+    return result;
+}
+
+// Publishes this context to the SIGPROF handler for the duration of the call; nested calls restore the outer one.
+result_t execute_profile(vm_t* vm) {
+    vm_t* outer_vm = profile_vm;
+    int64_t outer_ip = profile_ip;
+    int64_t outer_bp = profile_bp;
+    __atomic_store_n(&profile_vm, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_ip, vm->ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_bp, vm->bp, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_vm, vm, __ATOMIC_RELAXED);
+    result_t result = execute_loop(vm, TRUE, FALSE, FALSE, FALSE);
+    __atomic_store_n(&profile_vm, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_ip, outer_ip, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_bp, outer_bp, __ATOMIC_RELAXED);
+    __atomic_store_n(&profile_vm, outer_vm, __ATOMIC_RELAXED);
+    return result;
+}
+
+result_t execute_pgo(vm_t* vm) {
+    return execute_loop(vm, FALSE, TRUE, FALSE, FALSE);
+}
+
+result_t execute_stats(vm_t* vm) {
+    return execute_loop(vm, FALSE, FALSE, TRUE, FALSE);
+}
+
+result_t execute_checked(vm_t* vm) {
+    return execute_loop(vm, FALSE, FALSE, FALSE, TRUE);
 }
 
-int main() {
-    if (compile() == ERR) {
-        puts("Failed to compile");
-        return 1;
+// The variants are exclusive: a checked VM is not instrumented, counted or sampled, an instrumented one is not counted
+// or sampled, and a counted one is not sampled.
+result_t execute(vm_t* vm) {
+    if (vm->ischecked) {
+        return execute_checked(vm);
     }
-    if (execute() == ERR) {
-        puts("Failed to execute");
-        return 1;
+    if (vm->pgo != NULL) {
+        return execute_pgo(vm);
     }
-    return 0;
+    if (vm->stats != NULL) {
+        return execute_stats(vm);
+    }
+    if (vm->profile != NULL) {
+        return execute_profile(vm);
+    }
+    return execute_loop(vm, FALSE, FALSE, FALSE, FALSE);
+}
+
+symbol_t* vm_find(vm_t* vm, const char* name) {
+    for (int64_t i = 0; i < vm->symbol_cnt; i++) {
+        token_t token = (token_t){.data = vm->symbol[i].name, .size = vm->symbol[i].name_size};
+        if (token_iseqstr(&token, name)) {
+            return &vm->symbol[i];
+        }
+    }
+    return NULL;
+}
+
+result_t vm_resume(vm_t* vm, int64_t* ret) {
+    result_t result = execute(vm);
+    if (result == OK) {
+        *ret = vm->mem->bin[vm->sp - 1];
+    }
+    return result;
+}
+
+// Lays out a call frame at call_base exactly as TY_INST_CALL would, returning through the END at GLOBALADDR_END.
+result_t vm_call(vm_t* vm, symbol_t* fn, const int64_t* argv, int64_t argc, int64_t* ret) {
+    int64_t* bin = vm->mem->bin;
+    int64_t base = vm->call_base;
+    if (argc != fn->argc) {
+        puts("Error: Wrong number of arguments in vm_call");
+        return ERR;
+    }
+    for (int64_t i = 0; i < argc; i++) {
+        bin[base + i] = argv[i];
+    }
+    bin[base + argc + 0] = CODE_ADDR(GLOBALADDR_END);
+    bin[base + argc + 1] = base + argc;
+    bin[base + argc + 2] = 0;
+    vm->ip = fn->addr;
+    vm->bp = base + argc + 3;
+    vm->sp = base + argc + MEM_STACK_SIZE;
+    return vm_resume(vm, ret);
+}
+
+// Forks a copy-on-write child of a VM that execute left at _snapshot. In the child, _snapshot returns job.
+// Interval timers are not inherited, so the child re-arms the profiling timer.
+int64_t vm_fork(vm_t* vm, int64_t job) {
+    fflush(stdout);
+    int64_t pid = fork();
+    if (pid == 0) {
+        vm->mem->bin[vm->sp - 1] = job;
+        vm->issnapshot = FALSE;
+        if (profile_user > 0) {
+            profile_timer(PROFILE_INTERVAL_US);
+        }
+    }
+    return pid;
 }
\ No newline at end of file
@@ -0,0 +1,432 @@
+#ifndef LKJSCRIPT_H
+#define LKJSCRIPT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define MEM_SIZE (1024 * 1024 * 16)
+#define MEM_GLOBAL_SIZE 32
+#define MEM_STACK_SIZE 256
+#define MEM_HEAP_SIZE (1024 * 512)
+#define MEM_MAP_SIZE (1024 * 1024 * 1024)
+#define MEM_PAGE_SIZE 4096
+#define MEM_TASK_STACK_SIZE (1024 * 32)
+#define MEM_CO_STACK_SIZE (1024 * 32)
+
+#define CODE_ADDR(addr) ((addr) * (int64_t)sizeof(int64_t))
+#define CODE_LABEL_SIZE 4
+
+#define HEAP_CLASS_CNT 8
+#define HEAP_SPLIT_MIN 16
+
+#define MEMO_SIZE 4096
+#define MEMO_ARG_MAX 7
+#define MEMO_PROBE_MAX 8
+
+#define TASK_MAX 4096
+#define TASK_WORKER_MAX 16
+#define TASK_CHUNK_PER_WORKER 4
+
+#define CO_MAX 256
+
+#define SYMBOL_MAX 1024
+#define SYMBOL_NAME_MAX 64
+
+#define FUEL_TIME_INTERVAL (1024 * 64)
+#define FUEL_BUDGET_GRANT (1024 * 64)
+
+#define DEBUG_MAX (MEM_SIZE / sizeof(int64_t) / 6)
+
+#define PROFILE_STACK_MAX 4096
+#define PROFILE_DEPTH_MAX 32
+#define PROFILE_PROBE_MAX 64
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_TOP 10
+
+#define PGO_SITE_MAX (1024 * 64)
+
+#define STATS_OP_CNT 256
+
+typedef enum {
+    FALSE = 0,
+    TRUE = 1,
+} bool_t;
+
+typedef enum {
+    OK = 0,
+    ERR = 1,
+    EXHAUST = 2,
+    SUSPEND = 3,
+    SNAPSHOT = 4,
+} result_t;
+
+typedef enum {
+    GLOBALADDR_ZERO,
+    GLOBALADDR_HEAP_TOP,
+    GLOBALADDR_HEAP_LIVE,
+    GLOBALADDR_HEAP_CNT,
+    GLOBALADDR_HEAP_IDLE,
+    GLOBALADDR_HEAP_LARGE,
+    GLOBALADDR_MAP_TOP,
+    GLOBALADDR_END,
+    GLOBALADDR_CO_EXIT,
+    GLOBALADDR_CO_FREE,
+    GLOBALADDR_CO_BASE,
+    GLOBALADDR_HEAP_CLASS,
+    GLOBALADDR_HEAP_CLASS_END = GLOBALADDR_HEAP_CLASS + HEAP_CLASS_CNT,
+} globaladdr_t;
+
+typedef enum {
+
+    TY_NULL,
+
+    TY_INST_NOP,
+    TY_INST_END,
+    TY_INST_CO_EXIT,
+
+    TY_INST_PUSH_CONST,
+    TY_INST_PUSH_LOCAL_VAL,
+    TY_INST_PUSH_LOCAL_ADDR,
+    TY_INST_PUSH_FN,
+    TY_INST_PUSH_CONST8,
+    TY_INST_PUSH_CONST32,
+    TY_INST_PUSH_LOCAL_VAL8,
+    TY_INST_PUSH_LOCAL_ADDR8,
+    TY_INST_JMP,
+    TY_INST_JZ,
+    TY_INST_JNZ,
+    TY_INST_CALL,
+    TY_INST_RETURN,
+    TY_INST_MEMO_ENTER,
+    TY_INST_MEMO_RETURN,
+
+    TY_INST_ASSIGN1,
+    TY_INST_ASSIGN2,
+    TY_INST_ASSIGN3,
+    TY_INST_ASSIGN4,
+
+    TY_INST_OR,
+    TY_INST_AND,
+    TY_INST_EQ,
+    TY_INST_NE,
+    TY_INST_LT,
+    TY_INST_LE,
+    TY_INST_GT,
+    TY_INST_GE,
+    TY_INST_NOT,
+    TY_INST_ADD,
+    TY_INST_SUB,
+    TY_INST_MUL,
+    TY_INST_DIV,
+    TY_INST_MOD,
+    TY_INST_SHL,
+    TY_INST_SHR,
+    TY_INST_BITOR,
+    TY_INST_BITXOR,
+    TY_INST_BITAND,
+
+    TY_INST_DEREF,
+    TY_INST_DEREF8,
+    TY_INST_DEREF32,
+    TY_INST_NEG,
+    TY_INST_BITNOT,
+
+    TY_INST_READ,
+    TY_INST_WRITE,
+    TY_INST_USLEEP,
+    TY_INST_MEMCPY,
+    TY_INST_MEMSET,
+    TY_INST_MEMCMP,
+    TY_INST_MEMCHR,
+    TY_INST_VADD,
+    TY_INST_VSUB,
+    TY_INST_VMUL,
+    TY_INST_VSHL,
+    TY_INST_VSHR,
+    TY_INST_VADDS,
+    TY_INST_VSUBS,
+    TY_INST_VMULS,
+    TY_INST_VSHLS,
+    TY_INST_VSHRS,
+    TY_INST_VMULSHR,
+    TY_INST_VSUM,
+    TY_INST_VMIN,
+    TY_INST_VMAX,
+    TY_INST_VDOT,
+    TY_INST_ALLOC,
+    TY_INST_FREE,
+    TY_INST_HEAPSTAT,
+    TY_INST_MMAP,
+    TY_INST_MUNMAP,
+    TY_INST_MEMOSTAT,
+    TY_INST_SPAWN,
+    TY_INST_JOIN,
+    TY_INST_PFOR,
+    TY_INST_FETCHADD,
+    TY_INST_CAS,
+    TY_INST_GO,
+    TY_INST_YIELD,
+    TY_INST_SNAPSHOT,
+
+    TY_LABEL,
+    TY_LABEL_SCOPE_OPEN,
+    TY_LABEL_SCOPE_CLOSE,
+    TY_LABEL_COLD_OPEN,
+    TY_LABEL_COLD_CLOSE,
+
+} type_t;
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_I8,
+    OPERAND_I32,
+    OPERAND_I64,
+    OPERAND_LABEL,
+} operand_t;
+
+typedef struct {
+    const char* data;
+    int64_t size;
+} token_t;
+
+typedef struct {
+    type_t type;
+    token_t* token;
+    int64_t val;
+} node_t;
+
+typedef struct {
+    token_t* key;
+    int64_t val;
+} pair_t;
+
+typedef struct {
+    int64_t bin[MEM_SIZE / sizeof(int64_t) / 6];
+    char src[MEM_SIZE / sizeof(char) / 6];
+    token_t token[MEM_SIZE / sizeof(token_t) / 6];
+    node_t node[MEM_SIZE / sizeof(node_t) / 6];
+    pair_t map[MEM_SIZE / sizeof(pair_t) / 6];
+} compile_t;
+
+typedef union {
+    int64_t bin[(MEM_SIZE + MEM_MAP_SIZE) / sizeof(int64_t)];
+    compile_t compile;
+} mem_t;
+
+typedef struct {
+    const char* name;
+    type_t type;
+    int64_t argc;
+} builtin_t;
+
+typedef struct {
+    int64_t key[MEMO_ARG_MAX + 1];
+    int64_t val;
+} memo_entry_t;
+
+typedef struct {
+    memo_entry_t entry[MEMO_SIZE];
+    int64_t cnt;
+    int64_t hit;
+    int64_t miss;
+} memo_t;
+
+typedef int64_t vec_t __attribute__((vector_size(32), aligned(8), may_alias));
+
+typedef struct {
+    int64_t fn;
+    int64_t begin;
+    int64_t end;
+    int64_t val;
+    result_t result;
+    bool_t isused;
+    bool_t isdone;
+} task_t;
+
+typedef struct {
+    char name[SYMBOL_NAME_MAX];
+    int64_t name_size;
+    int64_t addr;
+    int64_t argc;
+    int64_t stack_max;
+} symbol_t;
+
+typedef struct {
+    int64_t addr;
+    int64_t line;
+    int64_t fn;
+} debug_t;
+
+typedef struct {
+    int64_t state;
+    int64_t cnt;
+    int64_t depth;
+    int64_t frame[PROFILE_DEPTH_MAX];
+} profile_stack_t;
+
+typedef struct {
+    profile_stack_t stack[PROFILE_STACK_MAX];
+    int64_t sample;
+    int64_t drop;
+} profile_t;
+
+// One instrumented site: an if's JZ/JNZ (cnt[FALSE], cnt[TRUE] by condition), a CALL, or a loop's back-edge JMP.
+// A CALL keeps a copy of the callee's name, since the run may overwrite compile_t.
+typedef struct {
+    int64_t token;
+    int64_t addr;
+    type_t type;
+    int64_t cnt[2];
+    char name[SYMBOL_NAME_MAX];
+    int64_t name_size;
+} pgo_site_t;
+
+typedef struct {
+    uint64_t hash;
+    bool_t ismatch;
+    int64_t site_cnt;
+    pgo_site_t site[PGO_SITE_MAX];
+} pgo_t;
+
+typedef enum {
+    STAGE_READ,
+    STAGE_TOKENIZE,
+    STAGE_PARSE,
+    STAGE_LAYOUT,
+    STAGE_ANALYZE,
+    STAGE_PURITY,
+    STAGE_TOBIN,
+    STAGE_LINK,
+    STAGE_SYMBOL,
+    STAGE_VERIFY,
+    STAGE_CNT,
+} stage_t;
+
+// Compile-time fields are filled by compile; the rest accumulate over every execute of the context.
+typedef struct {
+    int64_t stage_ns[STAGE_CNT];
+    int64_t src_size;
+    int64_t token_cnt;
+    int64_t node_cnt;
+    int64_t symbol_cnt;
+    int64_t code_size;
+    int64_t dispatch;
+    int64_t op[STATS_OP_CNT];
+    int64_t frame_peak;
+    int64_t read_cnt;
+    int64_t read_size;
+    int64_t write_cnt;
+    int64_t write_size;
+} stats_t;
+
+typedef enum {
+    CO_FREE,
+    CO_RUN,
+    CO_READY,
+    CO_WAIT_FD,
+    CO_WAIT_TIME,
+    CO_WAIT_ALL,
+} co_state_t;
+
+typedef struct {
+    co_state_t state;
+    int64_t stack;
+    int64_t stack_end;
+    int64_t ip;
+    int64_t sp;
+    int64_t bp;
+    int64_t fd;
+    int64_t events;
+    int64_t wake;
+} co_t;
+
+typedef struct {
+    co_t co[CO_MAX];
+    int64_t ready[CO_MAX];
+    int64_t ready_head;
+    int64_t ready_cnt;
+    int64_t cur;
+    int64_t alive;
+    int64_t epfd;
+} sched_t;
+
+typedef struct {
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    int64_t buf[TASK_MAX] __attribute__((aligned(64)));
+} task_deque_t;
+
+typedef struct task_pool_t task_pool_t;
+
+typedef struct {
+    mem_t* mem;
+    memo_t* memo;
+    symbol_t* symbol;
+    int64_t symbol_cnt;
+    debug_t* debug;
+    int64_t debug_cnt;
+    int64_t fn_end;
+    int64_t code_end;
+    profile_t* profile;
+    pgo_t* pgo;
+    pgo_t* pgo_use;
+    stats_t* stats;
+    int64_t call_base;
+    task_pool_t* pool;
+    int64_t worker;
+    int64_t worker_cnt;
+    sched_t* sched;
+    int64_t fuel;
+    int64_t grant;
+    int64_t budget;
+    int64_t deadline;
+    int64_t slice;
+    bool_t issnapshot;
+    bool_t ischecked;
+    int64_t ip;
+    int64_t sp;
+    int64_t bp;
+    int64_t stack_end;
+    int64_t fd[3];
+} vm_t;
+
+struct task_pool_t {
+    vm_t worker[TASK_WORKER_MAX];
+    pthread_t thread[TASK_WORKER_MAX];
+    task_deque_t deque[TASK_WORKER_MAX];
+    task_t task[TASK_MAX];
+    int64_t task_free[TASK_MAX];
+    int64_t task_free_cnt;
+    int64_t worker_cnt;
+    int64_t pending;
+    int64_t budget;
+    int64_t idle;
+    bool_t isstop;
+    pthread_mutex_t lock;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+extern const char* stage_name[STAGE_CNT];
+
+result_t vm_init(vm_t* vm);
+void vm_free(vm_t* vm);
+void vm_setfuel(vm_t* vm);
+int64_t vm_now();
+result_t compile(vm_t* vm, const char* path);
+result_t compile_str(vm_t* vm, const char* src, int64_t size);
+result_t execute(vm_t* vm);
+symbol_t* vm_find(vm_t* vm, const char* name);
+result_t vm_call(vm_t* vm, symbol_t* fn, const int64_t* argv, int64_t argc, int64_t* ret);
+result_t vm_resume(vm_t* vm, int64_t* ret);
+int64_t vm_fork(vm_t* vm, int64_t job);
+result_t vm_profile(vm_t* vm);
+int64_t vm_profile_fold(vm_t* vm, int64_t fd);
+int64_t vm_profile_report(vm_t* vm, int64_t fd, int64_t top);
+result_t vm_pgo(vm_t* vm);
+int64_t vm_pgo_write(vm_t* vm, int64_t fd);
+result_t vm_pgo_load(vm_t* vm, int64_t fd);
+result_t vm_stats(vm_t* vm);
+int64_t vm_stats_report(vm_t* vm, int64_t fd, bool_t isjson);
+
+#endif
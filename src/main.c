@@ -0,0 +1,368 @@
+#include "lkjscript.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SRC_PATH "./lkjscriptsrc"
+
+typedef struct {
+    const char* src;
+    const char* in;
+    vm_t vm;
+    result_t result;
+} job_t;
+
+typedef struct {
+    job_t* job;
+    int64_t job_cnt;
+    int64_t next;
+    int64_t worker_cnt;
+    int64_t budget;
+    int64_t time_limit;
+    int64_t slice;
+    int64_t profile_top;
+    const char* pgo_use;
+    bool_t ispgo;
+    bool_t isstats;
+    bool_t isjson;
+    bool_t ischecked;
+    bool_t isout;
+    bool_t isserver;
+} runner_t;
+
+result_t runner_open(runner_t* runner, job_t* job) {
+    vm_t* vm = &job->vm;
+    if (job->in != NULL) {
+        vm->fd[0] = open(job->in, O_RDONLY);
+        if (vm->fd[0] == -1) {
+            printf("Error: Failed to open %s\n", job->in);
+            return ERR;
+        }
+    }
+    if (runner->isout) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.out", job->in != NULL ? job->in : job->src);
+        vm->fd[1] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (vm->fd[1] == -1) {
+            printf("Error: Failed to open %s\n", path);
+            return ERR;
+        }
+    }
+    return OK;
+}
+
+void runner_limit(runner_t* runner, vm_t* vm) {
+    vm->ischecked = runner->ischecked;
+    vm->budget = runner->budget;
+    vm->deadline = runner->time_limit > 0 ? vm_now() + runner->time_limit * 1000000 : 0;
+    vm->slice = runner->slice;
+    vm_setfuel(vm);
+}
+
+result_t runner_pgo_load(runner_t* runner, vm_t* vm) {
+    int fd = open(runner->pgo_use, O_RDONLY);
+    if (fd == -1) {
+        printf("Error: Failed to open %s\n", runner->pgo_use);
+        return ERR;
+    }
+    result_t result = vm_pgo_load(vm, fd);
+    close(fd);
+    return result;
+}
+
+result_t runner_start(runner_t* runner, job_t* job) {
+    vm_t* vm = &job->vm;
+    result_t result = vm_init(vm);
+    if (runner->worker_cnt > 0) {
+        vm->worker_cnt = runner->worker_cnt;
+    }
+    if (result == OK && runner->profile_top > 0) {
+        result = vm_profile(vm);
+    }
+    if (result == OK && runner->ispgo) {
+        result = vm_pgo(vm);
+    }
+    if (result == OK && runner->isstats) {
+        result = vm_stats(vm);
+    }
+    if (result == OK && runner->pgo_use != NULL) {
+        result = runner_pgo_load(runner, vm);
+    }
+    if (result == OK) {
+        result = runner_open(runner, job);
+    }
+    if (result == OK && compile(vm, job->src) == ERR) {
+        printf("Failed to compile %s\n", job->src);
+        result = ERR;
+    }
+    runner_limit(runner, vm);
+    return result;
+}
+
+void runner_stop(job_t* job) {
+    if (job->vm.fd[0] > STDERR_FILENO) {
+        close(job->vm.fd[0]);
+    }
+    if (job->vm.fd[1] > STDERR_FILENO) {
+        close(job->vm.fd[1]);
+    }
+    vm_free(&job->vm);
+}
+
+// Writes the job's folded stacks to <input>.folded (or <src>.folded) and its top functions and lines to stderr.
+void runner_profile(runner_t* runner, job_t* job) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.folded", job->in != NULL ? job->in : job->src);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Error: Failed to open %s\n", path);
+    } else {
+        vm_profile_fold(&job->vm, fd);
+        close(fd);
+    }
+    vm_profile_report(&job->vm, STDERR_FILENO, runner->profile_top);
+}
+
+// Writes the job's branch, call and loop counts to <input>.pgo (or <src>.pgo) for a later -u.
+void runner_pgo(job_t* job) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.pgo", job->in != NULL ? job->in : job->src);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Error: Failed to open %s\n", path);
+        return;
+    }
+    vm_pgo_write(&job->vm, fd);
+    close(fd);
+}
+
+result_t runner_finish(runner_t* runner, job_t* job, result_t result) {
+    if (result == ERR) {
+        printf("Failed to execute %s\n", job->src);
+    } else if (result == EXHAUST) {
+        printf("Error: %s exhausted its budget\n", job->src);
+    }
+    if (runner->profile_top > 0) {
+        runner_profile(runner, job);
+    }
+    if (runner->ispgo) {
+        runner_pgo(job);
+    }
+    if (runner->isstats) {
+        vm_stats_report(&job->vm, STDERR_FILENO, runner->isjson);
+    }
+    runner_stop(job);
+    return result;
+}
+
+result_t runner_job(runner_t* runner, job_t* job) {
+    if (runner_start(runner, job) == ERR) {
+        runner_stop(job);
+        return ERR;
+    }
+    return runner_finish(runner, job, execute(&job->vm));
+}
+
+// Round-robins fuel slices of every job on the calling thread until all of them finish.
+void runner_slices(runner_t* runner) {
+    int64_t live = 0;
+    for (int64_t i = 0; i < runner->job_cnt; i++) {
+        if (runner_start(runner, &runner->job[i]) == ERR) {
+            runner_stop(&runner->job[i]);
+            runner->job[i].result = ERR;
+        } else {
+            runner->job[i].result = SUSPEND;
+            live++;
+        }
+    }
+    while (live > 0) {
+        for (int64_t i = 0; i < runner->job_cnt; i++) {
+            if (runner->job[i].result != SUSPEND) {
+                continue;
+            }
+            result_t result = execute(&runner->job[i].vm);
+            if (result != SUSPEND) {
+                runner->job[i].result = runner_finish(runner, &runner->job[i], result);
+                live--;
+            }
+        }
+    }
+}
+
+void* runner_worker(void* arg) {
+    runner_t* runner = arg;
+    while (TRUE) {
+        int64_t i = __atomic_fetch_add(&runner->next, 1, __ATOMIC_RELAXED);
+        if (i >= runner->job_cnt) {
+            return NULL;
+        }
+        runner->job[i].result = runner_job(runner, &runner->job[i]);
+    }
+}
+
+int runner_status(result_t result) {
+    return result == ERR ? 1 : result == EXHAUST ? 2 : 0;
+}
+
+// The child resumes the server's frozen VM with the job's own fds and limits.
+int runner_child(runner_t* runner, vm_t* server, job_t* job) {
+    job->vm = *server;
+    job->vm.fd[0] = STDIN_FILENO;
+    job->vm.fd[1] = STDOUT_FILENO;
+    if (runner_open(runner, job) == ERR) {
+        runner_stop(job);
+        fflush(stdout);
+        return 1;
+    }
+    runner_limit(runner, &job->vm);
+    int status = runner_status(runner_finish(runner, job, execute(&job->vm)));
+    fflush(stdout);
+    return status;
+}
+
+// Runs the src once up to _snapshot, then forks a copy-on-write child per job that resumes from there.
+int runner_server(runner_t* runner, int64_t child_max) {
+    job_t server = (job_t){.src = runner->job[0].src, .in = NULL, .result = OK};
+    bool_t isout = runner->isout;
+    runner->isout = FALSE;
+    result_t result = runner_start(runner, &server);
+    runner->isout = isout;
+    if (result == ERR) {
+        runner_stop(&server);
+        return 1;
+    }
+    server.vm.issnapshot = TRUE;
+    result = execute(&server.vm);
+    if (result != SNAPSHOT) {
+        result = runner_finish(runner, &server, result);
+        if (result == OK) {
+            printf("Error: %s ended before _snapshot\n", server.src);
+            result = ERR;
+        }
+        return runner_status(result);
+    }
+    int status = 0;
+    int64_t running = 0;
+    int64_t next = 0;
+    while (next < runner->job_cnt || running > 0) {
+        if (next < runner->job_cnt && running < child_max) {
+            int64_t pid = vm_fork(&server.vm, next);
+            if (pid == 0) {
+                _exit(runner_child(runner, &server.vm, &runner->job[next]));
+            } else if (pid == -1) {
+                puts("Error: Failed to fork");
+                status = 1;
+                next = runner->job_cnt;
+            } else {
+                running++;
+                next++;
+            }
+            continue;
+        }
+        int child_status = 0;
+        if (wait(&child_status) == -1) {
+            break;
+        }
+        running--;
+        int code = WIFEXITED(child_status) ? WEXITSTATUS(child_status) : 1;
+        if (code == 1 || (code == 2 && status == 0)) {
+            status = code;
+        }
+    }
+    runner_stop(&server);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    job_t job[argc + 1];
+    runner_t runner = (runner_t){.job = job, .job_cnt = 0, .next = 0, .worker_cnt = 0, .budget = -1, .time_limit = 0, .slice = 0, .profile_top = 0, .pgo_use = NULL, .ispgo = FALSE, .isstats = FALSE, .isjson = FALSE, .ischecked = FALSE, .isout = FALSE, .isserver = FALSE};
+    const char* in[argc];
+    int64_t in_cnt = 0;
+    int64_t thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:t:f:l:s:p:u:c:i:gkoS")) != -1) {
+        if (opt == 'j' && sscanf(optarg, "%" SCNd64, &thread_cnt) == 1 && thread_cnt > 0) {
+            continue;
+        } else if (opt == 't' && sscanf(optarg, "%" SCNd64, &runner.worker_cnt) == 1 && runner.worker_cnt > 0) {
+            continue;
+        } else if (opt == 'f' && sscanf(optarg, "%" SCNd64, &runner.budget) == 1 && runner.budget >= 0) {
+            continue;
+        } else if (opt == 'l' && sscanf(optarg, "%" SCNd64, &runner.time_limit) == 1 && runner.time_limit > 0) {
+            continue;
+        } else if (opt == 's' && sscanf(optarg, "%" SCNd64, &runner.slice) == 1 && runner.slice > 0) {
+            continue;
+        } else if (opt == 'p' && sscanf(optarg, "%" SCNd64, &runner.profile_top) == 1 && runner.profile_top > 0) {
+            continue;
+        } else if (opt == 'u') {
+            runner.pgo_use = optarg;
+        } else if (opt == 'c' && (strcmp(optarg, "text") == 0 || strcmp(optarg, "json") == 0)) {
+            runner.isstats = TRUE;
+            runner.isjson = strcmp(optarg, "json") == 0;
+        } else if (opt == 'k') {
+            runner.ischecked = TRUE;
+        } else if (opt == 'g') {
+            runner.ispgo = TRUE;
+        } else if (opt == 'i') {
+            in[in_cnt++] = optarg;
+        } else if (opt == 'o') {
+            runner.isout = TRUE;
+        } else if (opt == 'S') {
+            runner.isserver = TRUE;
+        } else {
+            puts("Usage: lkjscript [-j threads] [-t workers] [-f fuel] [-l ms] [-k] [-s slice] [-p top] [-g] [-u profile] [-c text|json] [-S] [-o] [-i input]... [src]...");
+            return 1;
+        }
+    }
+    if (in_cnt > 0 && argc - optind > 1) {
+        puts("Error: -i runs copies of a single src");
+        return 1;
+    }
+    if (runner.isserver && (in_cnt == 0 || runner.slice > 0)) {
+        puts("Error: -S forks one child per -i input and cannot be combined with -s");
+        return 1;
+    }
+    const char* src = optind < argc ? argv[optind] : SRC_PATH;
+    if (in_cnt > 0) {
+        for (int64_t i = 0; i < in_cnt; i++) {
+            job[runner.job_cnt++] = (job_t){.src = src, .in = in[i], .result = OK};
+        }
+    } else if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            job[runner.job_cnt++] = (job_t){.src = argv[i], .in = NULL, .result = OK};
+        }
+    } else {
+        job[runner.job_cnt++] = (job_t){.src = src, .in = NULL, .result = OK};
+    }
+
+    if (runner.isserver) {
+        return runner_server(&runner, thread_cnt);
+    } else if (runner.slice > 0) {
+        runner_slices(&runner);
+    } else if (runner.job_cnt == 1) {
+        runner_worker(&runner);
+    } else {
+        if (thread_cnt > runner.job_cnt) {
+            thread_cnt = runner.job_cnt;
+        }
+        pthread_t thread[thread_cnt];
+        for (int64_t i = 0; i < thread_cnt; i++) {
+            pthread_create(&thread[i], NULL, runner_worker, &runner);
+        }
+        for (int64_t i = 0; i < thread_cnt; i++) {
+            pthread_join(thread[i], NULL);
+        }
+    }
+    int status = 0;
+    for (int64_t i = 0; i < runner.job_cnt; i++) {
+        if (job[i].result == ERR) {
+            return 1;
+        } else if (job[i].result == EXHAUST) {
+            status = 2;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,54 @@
+// Compiles and runs several programs on one VM; each must behave as it would on a fresh one.
+#include "lkjscript.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Compiles src on vm, runs it and checks what its result() returns.
+int reuse_run(vm_t* vm, const char* name, const char* src, int64_t expected) {
+    int64_t ret = 0;
+    if (compile_str(vm, src, strlen(src)) != OK || execute(vm) != OK || vm_call(vm, vm_find(vm, "result"), NULL, 0, &ret) != OK) {
+        printf("api_reuse: %s FAIL (did not run)\n", name);
+        return 1;
+    }
+    if (ret != expected) {
+        printf("api_reuse: %s FAIL (result %" PRId64 ", expected %" PRId64 ")\n", name, ret, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    vm_t vm;
+    if (vm_init(&vm) == ERR) {
+        vm_free(&vm);
+        return 1;
+    }
+    // Maps this test's source file, so the first window page holds its text until the next compile.
+    vm.fd[0] = open(argc > 1 ? argv[1] : "api_reuse.c", O_RDONLY);
+    int fail = 0;
+    fail |= reuse_run(&vm, "alloc_free",
+                      "fn result() {\n    return 1\n}\n"
+                      "&p = _alloc(1)\n&r = _free(p)\n&q = _alloc(200)\n&r = _free(q)\n",
+                      1);
+    // Word 4 is GLOBALADDR_HEAP_IDLE, which the freed blocks above left non-zero.
+    fail |= reuse_run(&vm, "alloc_after_free",
+                      "fn result() {\n    return (*4 == 0) + (_alloc(1) != 0) + (_alloc(200) != 0)\n}\n",
+                      3);
+    // Word 2097152 is the first word of the map window.
+    fail |= reuse_run(&vm, "mmap",
+                      "fn result() {\n    &base = _mmap(0, &size)\n    return (base == 2097152) + (size > 0)\n}\n",
+                      2);
+    fail |= reuse_run(&vm, "window_after_mmap",
+                      "fn result() {\n    return *2097152 == 0\n}\n",
+                      1);
+    close(vm.fd[0]);
+    vm_free(&vm);
+    if (fail == 0) {
+        puts("api_reuse: all ok");
+    }
+    return fail;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+# usage: tests/run.sh [lkjscript]
+# Runs every tests/*.lkj and compares its stdout with the matching .expected file. A "// flags: ..." line passes
+# options to lkjscript, a "// status: N" line sets the expected exit status (default 0) and a "// stdin: FILE" line
+# feeds FILE to stdin (default /dev/null).
+# Tests run from tests/, so error messages name them as NAME.lkj.
+BIN=$(cd "$(dirname "${1:-build/lkjscript}")" && pwd)/$(basename "${1:-build/lkjscript}")
+cd "$(dirname "$0")" || exit 1
+fail=0
+for src in *.lkj; do
+    name=${src%.lkj}
+    flags=$(sed -n 's|^// flags: ||p' "$src")
+    status=$(sed -n 's|^// status: ||p' "$src")
+    input=$(sed -n 's|^// stdin: ||p' "$src")
+    { out=$("$BIN" $flags "$src" < "${input:-/dev/null}"); rc=$?; } 2>/dev/null
+    if [ "$rc" != "${status:-0}" ] || [ "$out" != "$(cat "$name.expected")" ]; then
+        echo "test: $name FAIL (status $rc)"
+        fail=1
+    fi
+done
+[ $fail = 0 ] && echo "test: all ok"
+exit $fail